@@ -6,6 +6,7 @@
 #include <string.h>
 #include <math.h>
 #include <emmintrin.h>
+#include <immintrin.h>
 
 #define STB_IMAGE_IMPLEMENTATION
 #define STBI_ONLY_JPEG
@@ -45,12 +46,116 @@ typedef unsigned int uint;
 
 #define INVALID_CODE_PATH { printf("Invalid code path, file %s, line %d\n", __FILE__, __LINE__); exit(1); }
 
+// Both return the original value
+#if BUILD_WIN32
+inline i32 atomic_compare_exchange(i32 volatile *value, i32 new_value,
+                                   i32 expected) {
+  return _InterlockedCompareExchange((long volatile *)value, new_value,
+                                     expected);
+}
+inline i32 atomic_add(i32 volatile *value, i32 addend) {
+  return _InterlockedExchangeAdd((long volatile *)value, addend);
+}
+#else
+inline i32 atomic_compare_exchange(i32 volatile *value, i32 new_value,
+                                   i32 expected) {
+  return __sync_val_compare_and_swap(value, expected, new_value);
+}
+inline i32 atomic_add(i32 volatile *value, i32 addend) {
+  return __sync_fetch_and_add(value, addend);
+}
+#endif
+
+// The build only assumes SSE2. Functions using AVX2 are compiled for it
+// separately and only called if the CPU supports it
+#if BUILD_WIN32
+#define ED_AVX2
+inline bool cpu_supports_avx2() {
+  int info[4];
+  __cpuid(info, 1);
+  bool osxsave = (info[2] & (1 << 27)) != 0;
+  bool avx = (info[2] & (1 << 28)) != 0;
+  if (!osxsave || !avx) return false;
+  if ((_xgetbv(0) & 6) != 6) return false;  // OS saves the YMM registers
+  __cpuidex(info, 7, 0);
+  return (info[1] & (1 << 5)) != 0;
+}
+#else
+#define ED_AVX2 __attribute__((target("avx2")))
+inline bool cpu_supports_avx2() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+#endif
+
+// Index of the lowest set bit, the value must not be 0
+#if BUILD_WIN32
+inline int lowest_set_bit(u64 value) {
+  unsigned long index;
+  _BitScanForward64(&index, value);
+  return (int)index;
+}
+#else
+inline int lowest_set_bit(u64 value) { return __builtin_ctzll(value); }
+#endif
+
 #define COUNT_OF(x) \
   ((sizeof(x) / sizeof(0 [x])) / ((size_t)(!(sizeof(x) % sizeof(0 [x])))))
 
 #ifdef ED_LEAKCHECK
 #define STB_LEAKCHECK_IMPLEMENTATION
 #include <include/stb_leakcheck.h>
+
+// Jobs allocate on all the threads, but stb_leakcheck keeps its list of
+// allocations without a lock
+global i32 volatile g_leakcheck_lock;
+
+inline void leakcheck_lock() {
+  while (atomic_compare_exchange(&g_leakcheck_lock, 1, 0) != 0) {
+    _mm_pause();
+  }
+}
+
+inline void leakcheck_unlock() {
+  atomic_compare_exchange(&g_leakcheck_lock, 0, 1);
+}
+
+inline void *locked_leakcheck_malloc(size_t size, char *file, int line) {
+  leakcheck_lock();
+  void *result = stb_leakcheck_malloc(size, file, line);
+  leakcheck_unlock();
+  return result;
+}
+
+inline void locked_leakcheck_free(void *pointer, char *file, int line) {
+  leakcheck_lock();
+  stb_leakcheck_free(pointer, file, line);
+  leakcheck_unlock();
+}
+
+inline void *locked_leakcheck_realloc(void *pointer, size_t size, char *file,
+                                      int line) {
+  leakcheck_lock();
+  void *result = stb_leakcheck_realloc(pointer, size, file, line);
+  leakcheck_unlock();
+  return result;
+}
+
+// Not wrapped by stb_leakcheck, but its blocks are freed like the others
+inline void *locked_leakcheck_calloc(size_t count, size_t size, char *file,
+                                     int line) {
+  void *result = locked_leakcheck_malloc(count * size, file, line);
+  if (result != NULL) memset(result, 0, count * size);
+  return result;
+}
+
+#undef malloc
+#undef free
+#undef realloc
+#define malloc(sz) locked_leakcheck_malloc(sz, __FILE__, __LINE__)
+#define calloc(n, sz) locked_leakcheck_calloc(n, sz, __FILE__, __LINE__)
+#define free(p) locked_leakcheck_free(p, __FILE__, __LINE__)
+#define realloc(p, sz) locked_leakcheck_realloc(p, sz, __FILE__, __LINE__)
 #endif  // ED_LEAKCHECK
 
 #include "include/stb_stretchy_buffer.h"
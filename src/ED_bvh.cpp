@@ -0,0 +1,788 @@
+struct BVH_Build_Bin {
+  AABBox aabb;
+  int count;
+};
+
+inline AABBox aabb_empty() {
+  AABBox result;
+  result.min = V3(INFINITY, INFINITY, INFINITY);
+  result.max = V3(-INFINITY, -INFINITY, -INFINITY);
+  return result;
+}
+
+inline void aabb_grow(AABBox *aabb, v3 point) {
+  for (int i = 0; i < 3; ++i) {
+    aabb->min.E[i] = min(aabb->min.E[i], point.E[i]);
+    aabb->max.E[i] = max(aabb->max.E[i], point.E[i]);
+  }
+}
+
+inline void aabb_grow(AABBox *aabb, AABBox other) {
+  aabb_grow(aabb, other.min);
+  aabb_grow(aabb, other.max);
+}
+
+inline r32 aabb_half_area(AABBox aabb) {
+  v3 d = aabb.max - aabb.min;
+  if (d.x < 0) return 0;  // empty
+  return d.x * d.y + d.y * d.z + d.z * d.x;
+}
+
+// Slab test which also returns the distance at which the ray enters the box
+inline bool ray_hits_aabb(AABBox aabb, v3 origin, v3 inv_direction,
+                          r32 t_max, r32 *t_entry) {
+  v3 t1 = (aabb.min - origin).hadamard(inv_direction);
+  v3 t2 = (aabb.max - origin).hadamard(inv_direction);
+
+  r32 tmin = max3(min(t1.x, t2.x), min(t1.y, t2.y), min(t1.z, t2.z));
+  r32 tmax = min3(max(t1.x, t2.x), max(t1.y, t2.y), max(t1.z, t2.z));
+
+  *t_entry = tmin;
+  return tmax >= tmin && tmax > 0 && tmin < t_max;
+}
+
+// Ray broadcast to all lanes once per traversal
+struct Ray4 {
+  v4 origin[3];
+  v4 direction[3];
+};
+
+inline Ray4 ray4_broadcast(Ray ray) {
+  Ray4 result;
+  for (int i = 0; i < 3; ++i) {
+    result.origin[i] = v4(ray.origin.E[i]);
+    result.direction[i] = v4(ray.direction.E[i]);
+  }
+  return result;
+}
+
+// Moller-Trumbore test of one ray against four triangles. Only hits
+// closer than hit->at are reported, returns the lane of the nearest
+// one or -1
+inline int ray_hits_triangle4(Ray4 *ray, BVH_Triangle4 *block,
+                              Triangle_Hit *hit) {
+  v4 e1x = v4::load(block->edge1[0]);
+  v4 e1y = v4::load(block->edge1[1]);
+  v4 e1z = v4::load(block->edge1[2]);
+  v4 e2x = v4::load(block->edge2[0]);
+  v4 e2y = v4::load(block->edge2[1]);
+  v4 e2z = v4::load(block->edge2[2]);
+  v4 dx = ray->direction[0];
+  v4 dy = ray->direction[1];
+  v4 dz = ray->direction[2];
+
+  // p = direction x edge2
+  v4 px = dy * e2z - dz * e2y;
+  v4 py = dz * e2x - dx * e2z;
+  v4 pz = dx * e2y - dy * e2x;
+
+  // A zero determinant (parallel ray or an empty lane) makes beta
+  // infinite or NaN, which fails the comparisons below
+  v4 det = e1x * px + e1y * py + e1z * pz;
+  v4 inv_det = v4(1.0f) / det;
+
+  v4 sx = ray->origin[0] - v4::load(block->v0[0]);
+  v4 sy = ray->origin[1] - v4::load(block->v0[1]);
+  v4 sz = ray->origin[2] - v4::load(block->v0[2]);
+  v4 beta = (sx * px + sy * py + sz * pz) * inv_det;
+
+  // q = s x edge1
+  v4 qx = sy * e1z - sz * e1y;
+  v4 qy = sz * e1x - sx * e1z;
+  v4 qz = sx * e1y - sy * e1x;
+  v4 gamma = (dx * qx + dy * qy + dz * qz) * inv_det;
+  v4 t = (e2x * qx + e2y * qy + e2z * qz) * inv_det;
+
+  v4 zero = v4::zero();
+  v4 mask = v4_and(cmpge(beta, zero), cmpge(gamma, zero),
+                   cmple(beta + gamma, v4(1.0f)));
+  mask = v4_and(mask, cmpgt(t, zero), cmplt(t, v4(hit->at)));
+  int lanes = movemask(mask);
+  if (lanes == 0) return -1;
+
+  int nearest = -1;
+  for (int i = 0; i < 4; ++i) {
+    if ((lanes & (1 << i)) && (nearest < 0 || t.E[i] < t.E[nearest])) {
+      nearest = i;
+    }
+  }
+  hit->at = t.E[nearest];
+  hit->barycentric[0] = 1.0f - beta.E[nearest] - gamma.E[nearest];
+  hit->barycentric[1] = beta.E[nearest];
+  hit->barycentric[2] = gamma.E[nearest];
+  return nearest;
+}
+
+// Slab test for all lanes of a packet, returns the mask of lanes which
+// hit the box closer than t_max
+inline v4 packet_hits_aabb(AABBox aabb, Ray_Packet *packet, v4 t_max,
+                           v4 *t_entry) {
+  v4 tmin = v4(-INFINITY);
+  v4 tmax = v4(INFINITY);
+  for (int i = 0; i < 3; ++i) {
+    v4 t1 = (v4(aabb.min.E[i]) - packet->origin[i]) * packet->inv_direction[i];
+    v4 t2 = (v4(aabb.max.E[i]) - packet->origin[i]) * packet->inv_direction[i];
+    tmin = vmax(tmin, vmin(t1, t2));
+    tmax = vmin(tmax, vmax(t1, t2));
+  }
+  *t_entry = tmin;
+  return v4_and(cmpge(tmax, tmin), cmpgt(tmax, v4::zero()),
+                cmplt(tmin, t_max));
+}
+
+// Moller-Trumbore test of all lanes of a packet against one triangle
+// of a block. Updates the lanes which hit it closer than before and
+// returns their mask
+inline v4 packet_hits_triangle(Ray_Packet *packet, BVH_Triangle4 *block,
+                               int lane, v4 active, Packet_Hit *hit) {
+  v4 e1x = v4(block->edge1[0][lane]);
+  v4 e1y = v4(block->edge1[1][lane]);
+  v4 e1z = v4(block->edge1[2][lane]);
+  v4 e2x = v4(block->edge2[0][lane]);
+  v4 e2y = v4(block->edge2[1][lane]);
+  v4 e2z = v4(block->edge2[2][lane]);
+  v4 dx = packet->direction[0];
+  v4 dy = packet->direction[1];
+  v4 dz = packet->direction[2];
+
+  v4 px = dy * e2z - dz * e2y;
+  v4 py = dz * e2x - dx * e2z;
+  v4 pz = dx * e2y - dy * e2x;
+  v4 inv_det = v4(1.0f) / (e1x * px + e1y * py + e1z * pz);
+
+  v4 sx = packet->origin[0] - v4(block->v0[0][lane]);
+  v4 sy = packet->origin[1] - v4(block->v0[1][lane]);
+  v4 sz = packet->origin[2] - v4(block->v0[2][lane]);
+  v4 beta = (sx * px + sy * py + sz * pz) * inv_det;
+
+  v4 qx = sy * e1z - sz * e1y;
+  v4 qy = sz * e1x - sx * e1z;
+  v4 qz = sx * e1y - sy * e1x;
+  v4 gamma = (dx * qx + dy * qy + dz * qz) * inv_det;
+  v4 t = (e2x * qx + e2y * qy + e2z * qz) * inv_det;
+
+  v4 zero = v4::zero();
+  v4 mask = v4_and(cmpge(beta, zero), cmpge(gamma, zero),
+                   cmple(beta + gamma, v4(1.0f)), active);
+  mask = v4_and(mask, cmpgt(t, zero), cmplt(t, hit->at));
+
+  hit->at = v4_select(hit->at, t, mask);
+  hit->barycentric[0] =
+      v4_select(hit->barycentric[0], v4(1.0f) - beta - gamma, mask);
+  hit->barycentric[1] = v4_select(hit->barycentric[1], beta, mask);
+  hit->barycentric[2] = v4_select(hit->barycentric[2], gamma, mask);
+  return mask;
+}
+
+inline bool lanes_diverged(int lanes) {
+  // Zero or one active lane left
+  return (lanes & (lanes - 1)) == 0;
+}
+
+inline Ray_Packet packet_from_rays(Ray rays[4]) {
+  Ray_Packet result;
+  for (int i = 0; i < 3; ++i) {
+    result.origin[i] = v4(rays[0].origin.E[i], rays[1].origin.E[i],
+                          rays[2].origin.E[i], rays[3].origin.E[i]);
+    result.direction[i] =
+        v4(rays[0].direction.E[i], rays[1].direction.E[i],
+           rays[2].direction.E[i], rays[3].direction.E[i]);
+    result.inv_direction[i] = v4(1.0f) / result.direction[i];
+  }
+  return result;
+}
+
+inline Ray packet_get_ray(Ray_Packet *packet, int lane) {
+  Ray result;
+  for (int i = 0; i < 3; ++i) {
+    result.origin.E[i] = packet->origin[i].E[lane];
+    result.direction.E[i] = packet->direction[i].E[lane];
+  }
+  return result;
+}
+
+// Steps into the children of an interior node for a packet. Returns
+// false if no lane hits either child
+static bool packet_visit_children(BVH_Node *nodes, int *node_id,
+                                  Ray_Packet *packet, v4 *mask,
+                                  v4 t_max, int *stack, v4 *stack_masks,
+                                  int *stack_size) {
+  int child0 = *node_id + 1;
+  int child1 = nodes[*node_id].offset;
+  v4 t0, t1;
+  v4 mask0 = v4_and(*mask, packet_hits_aabb(nodes[child0].aabb, packet,
+                                            t_max, &t0));
+  v4 mask1 = v4_and(*mask, packet_hits_aabb(nodes[child1].aabb, packet,
+                                            t_max, &t1));
+  int lanes0 = movemask(mask0);
+  int lanes1 = movemask(mask1);
+  if (lanes0 && lanes1) {
+    // Order the children by the first lane which hits both (if the
+    // lanes are disjoint the order doesn't matter)
+    int both = lanes0 & lanes1;
+    for (int lane = 0; lane < 4; ++lane) {
+      if (!(both & (1 << lane))) continue;
+      if (t1.E[lane] < t0.E[lane]) {
+        swap(child0, child1);
+        swap(mask0, mask1);
+      }
+      break;
+    }
+    stack[*stack_size] = child1;
+    stack_masks[*stack_size] = mask1;
+    (*stack_size)++;
+    *node_id = child0;
+    *mask = mask0;
+    return true;
+  } else if (lanes0) {
+    *node_id = child0;
+    *mask = mask0;
+    return true;
+  } else if (lanes1) {
+    *node_id = child1;
+    *mask = mask1;
+    return true;
+  }
+  return false;
+}
+
+// Pops the next node which still has lanes that haven't been culled
+// by closer hits
+static bool packet_pop_node(BVH_Node *nodes, int *node_id,
+                            Ray_Packet *packet, v4 *mask, v4 t_max,
+                            int *stack, v4 *stack_masks, int *stack_size) {
+  while (*stack_size > 0) {
+    (*stack_size)--;
+    *node_id = stack[*stack_size];
+    v4 t_entry;
+    *mask = v4_and(stack_masks[*stack_size],
+                   packet_hits_aabb(nodes[*node_id].aabb, packet, t_max,
+                                    &t_entry));
+    if (movemask(*mask)) return true;
+  }
+  return false;
+}
+
+static void bvh_build_node(BVH *bvh, int node_id, AABBox *primitive_aabbs,
+                           v3 *centroids, int start, int end, int depth,
+                           int max_leaf_size) {
+  // NOTE: bvh->nodes may be reallocated below, so refer to nodes by index
+  AABBox aabb = aabb_empty();
+  AABBox centroid_aabb = aabb_empty();
+  for (int i = start; i < end; ++i) {
+    int id = bvh->primitive_ids[i];
+    aabb_grow(&aabb, primitive_aabbs[id]);
+    aabb_grow(&centroid_aabb, centroids[id]);
+  }
+  bvh->nodes[node_id].aabb = aabb;
+
+  int count = end - start;
+  r32 leaf_cost = (r32)count;
+
+  // Find the best split using the surface area heuristic over binned
+  // centroids. The traversal step is assumed to cost as much as
+  // one primitive intersection
+  r32 best_cost = INFINITY;
+  int best_axis = -1;
+  int best_split = -1;
+  if (count > 1) {
+    r32 parent_area = aabb_half_area(aabb);
+    for (int axis = 0; axis < 3; ++axis) {
+      r32 axis_min = centroid_aabb.min.E[axis];
+      r32 axis_extent = centroid_aabb.max.E[axis] - axis_min;
+      if (axis_extent <= 0) continue;
+
+      BVH_Build_Bin bins[BVH::kNumBins];
+      for (int b = 0; b < BVH::kNumBins; ++b) {
+        bins[b].aabb = aabb_empty();
+        bins[b].count = 0;
+      }
+      r32 scale = BVH::kNumBins / axis_extent;
+      for (int i = start; i < end; ++i) {
+        int id = bvh->primitive_ids[i];
+        int b = (int)((centroids[id].E[axis] - axis_min) * scale);
+        b = min(b, BVH::kNumBins - 1);
+        bins[b].count++;
+        aabb_grow(&bins[b].aabb, primitive_aabbs[id]);
+      }
+
+      // Sweep from the right to get the area and count to the right of
+      // each split, then from the left to evaluate the cost
+      r32 right_area[BVH::kNumBins];
+      int right_count[BVH::kNumBins];
+      AABBox right_aabb = aabb_empty();
+      int count_so_far = 0;
+      for (int b = BVH::kNumBins - 1; b > 0; --b) {
+        aabb_grow(&right_aabb, bins[b].aabb);
+        count_so_far += bins[b].count;
+        right_area[b] = aabb_half_area(right_aabb);
+        right_count[b] = count_so_far;
+      }
+      AABBox left_aabb = aabb_empty();
+      count_so_far = 0;
+      for (int b = 1; b < BVH::kNumBins; ++b) {
+        aabb_grow(&left_aabb, bins[b - 1].aabb);
+        count_so_far += bins[b - 1].count;
+        if (count_so_far == 0 || right_count[b] == 0) continue;
+        r32 cost = 1.0f + (aabb_half_area(left_aabb) * count_so_far +
+                           right_area[b] * right_count[b]) /
+                              parent_area;
+        if (cost < best_cost) {
+          best_cost = cost;
+          best_axis = axis;
+          best_split = b;
+        }
+      }
+    }
+  }
+
+  // Traversal keeps at most one node per level on its stack
+  bool make_leaf = best_axis < 0 || depth >= BVH::kStackSize - 1 ||
+                   (count <= max_leaf_size && leaf_cost <= best_cost);
+  if (make_leaf) {
+    bvh->nodes[node_id].offset = start;
+    bvh->nodes[node_id].count = count;
+    return;
+  }
+
+  // Partition primitive ids in place
+  r32 axis_min = centroid_aabb.min.E[best_axis];
+  r32 scale =
+      BVH::kNumBins / (centroid_aabb.max.E[best_axis] - axis_min);
+  int *ids = bvh->primitive_ids;
+  int left = start;
+  int right = end - 1;
+  while (left <= right) {
+    int b = (int)((centroids[ids[left]].E[best_axis] - axis_min) * scale);
+    b = min(b, BVH::kNumBins - 1);
+    if (b < best_split) {
+      ++left;
+    } else {
+      swap(ids[left], ids[right]);
+      --right;
+    }
+  }
+  int middle = left;
+  assert(start < middle && middle < end);
+
+  int left_child = sb_count(bvh->nodes);
+  assert(left_child == node_id + 1);
+  sb_add(bvh->nodes, 1);
+  bvh_build_node(bvh, left_child, primitive_aabbs, centroids, start, middle,
+                 depth + 1, max_leaf_size);
+
+  int right_child = sb_count(bvh->nodes);
+  sb_add(bvh->nodes, 1);
+  bvh->nodes[node_id].offset = right_child;
+  bvh->nodes[node_id].count = 0;
+  bvh_build_node(bvh, right_child, primitive_aabbs, centroids, middle, end,
+                 depth + 1, max_leaf_size);
+}
+
+void BVH::build_from_aabbs(AABBox *aabbs, int count, int max_leaf_size) {
+  this->nodes = NULL;
+  this->primitive_ids = NULL;
+  this->triangle_blocks = NULL;
+  if (count == 0) return;
+
+  v3 *centroids = (v3 *)malloc(count * sizeof(*centroids));
+  sb_add(this->primitive_ids, count);
+  for (int i = 0; i < count; ++i) {
+    centroids[i] = (aabbs[i].min + aabbs[i].max) * 0.5f;
+    this->primitive_ids[i] = i;
+  }
+
+  // A binary tree with N leaves has 2N - 1 nodes
+  sb_reserve(this->nodes, 2 * count);
+  sb_add(this->nodes, 1);
+  bvh_build_node(this, 0, aabbs, centroids, 0, count, 0, max_leaf_size);
+
+  free(centroids);
+}
+
+void BVH::build(v3 *vertices, Triangle *triangles) {
+  TIMED_BLOCK();
+
+  int triangle_count = sb_count(triangles);
+  AABBox *triangle_aabbs =
+      (AABBox *)malloc(triangle_count * sizeof(*triangle_aabbs));
+  for (int i = 0; i < triangle_count; ++i) {
+    AABBox aabb = aabb_empty();
+    for (int j = 0; j < 3; ++j) {
+      aabb_grow(&aabb, vertices[triangles[i].indices[j]]);
+    }
+    triangle_aabbs[i] = aabb;
+  }
+
+  this->build_from_aabbs(triangle_aabbs, triangle_count, kMaxLeafSize);
+
+  free(triangle_aabbs);
+
+  // Pad every leaf to whole blocks. Leaves are contiguous in
+  // primitive_ids, so offsets only grow by the padding before them
+  int *padded_ids = NULL;
+  for (int i = 0; i < sb_count(this->nodes); ++i) {
+    BVH_Node *node = this->nodes + i;
+    if (node->count == 0) continue;
+    int offset = sb_count(padded_ids);
+    int num_blocks = (node->count + kBlockSize - 1) / kBlockSize;
+    int *ids = sb_add(padded_ids, num_blocks * kBlockSize);
+    for (int j = 0; j < num_blocks * kBlockSize; ++j) {
+      ids[j] = (j < node->count) ? this->primitive_ids[node->offset + j] : -1;
+    }
+    node->offset = offset;
+  }
+  sb_free(this->primitive_ids);
+  this->primitive_ids = padded_ids;
+
+  // The BVH is in model space, so the cache only depends on the mesh
+  // and doesn't need to be updated when the model moves
+  int num_blocks = sb_count(this->primitive_ids) / kBlockSize;
+  if (num_blocks == 0) return;
+  this->triangle_blocks = (BVH_Triangle4 *)_mm_malloc(
+      num_blocks * sizeof(*this->triangle_blocks), 16);
+  memset(this->triangle_blocks, 0,
+         num_blocks * sizeof(*this->triangle_blocks));
+  for (int i = 0; i < sb_count(this->primitive_ids); ++i) {
+    int id = this->primitive_ids[i];
+    if (id < 0) continue;
+    Triangle triangle = triangles[id];
+    v3 v0 = vertices[triangle.indices[0]];
+    v3 v1 = vertices[triangle.indices[1]];
+    v3 v2 = vertices[triangle.indices[2]];
+    v3 edge1 = v1 - v0;
+    v3 edge2 = v2 - v0;
+    BVH_Triangle4 *block = this->triangle_blocks + i / kBlockSize;
+    int lane = i % kBlockSize;
+    for (int axis = 0; axis < 3; ++axis) {
+      block->v0[axis][lane] = v0.E[axis];
+      block->edge1[axis][lane] = edge1.E[axis];
+      block->edge2[axis][lane] = edge2.E[axis];
+    }
+  }
+}
+
+bool BVH::intersect(Ray ray, Triangle_Hit *hit, int *triangle_id, int root) {
+  // Only hits closer than hit->at are reported
+  if (this->nodes == NULL) return false;
+
+  bool result = false;
+  v3 inv_direction = 1.0f / ray.direction;
+  Ray4 ray4 = ray4_broadcast(ray);
+
+  int stack[kStackSize];
+  int stack_size = 0;
+  int node_id = root;
+
+  r32 t_entry;
+  if (!ray_hits_aabb(this->nodes[root].aabb, ray.origin, inv_direction,
+                     hit->at, &t_entry)) {
+    return false;
+  }
+
+  for (;;) {
+    BVH_Node *node = this->nodes + node_id;
+    if (node->count > 0) {
+      // Leaves are padded, so the last block may hold empty lanes
+      int first_block = node->offset / kBlockSize;
+      int end_block = first_block + (node->count + kBlockSize - 1) / kBlockSize;
+      for (int b = first_block; b < end_block; ++b) {
+        int lane = ray_hits_triangle4(&ray4, this->triangle_blocks + b, hit);
+        if (lane >= 0) {
+          *triangle_id = this->primitive_ids[b * kBlockSize + lane];
+          result = true;
+        }
+      }
+    } else {
+      // Visit the nearer child first and keep the other one for later
+      int child0 = node_id + 1;
+      int child1 = node->offset;
+      r32 t0, t1;
+      bool hit0 = ray_hits_aabb(this->nodes[child0].aabb, ray.origin,
+                                inv_direction, hit->at, &t0);
+      bool hit1 = ray_hits_aabb(this->nodes[child1].aabb, ray.origin,
+                                inv_direction, hit->at, &t1);
+      if (hit0 && hit1) {
+        if (t1 < t0) swap(child0, child1);
+        stack[stack_size++] = child1;
+        node_id = child0;
+        continue;
+      } else if (hit0) {
+        node_id = child0;
+        continue;
+      } else if (hit1) {
+        node_id = child1;
+        continue;
+      }
+    }
+
+    // Pop the next node which hasn't been culled by a closer hit
+    bool found = false;
+    while (stack_size > 0) {
+      node_id = stack[--stack_size];
+      if (ray_hits_aabb(this->nodes[node_id].aabb, ray.origin, inv_direction,
+                        hit->at, &t_entry)) {
+        found = true;
+        break;
+      }
+    }
+    if (!found) break;
+  }
+
+  return result;
+}
+
+int BVH::intersect_packet(Ray_Packet *packet, v4 active, Packet_Hit *hit) {
+  // Returns the bit mask of lanes which found a closer hit
+  int result = 0;
+  if (this->nodes == NULL) return result;
+
+  int stack[kStackSize];
+  v4 stack_masks[kStackSize];
+  int stack_size = 0;
+  int node_id = 0;
+
+  v4 t_entry;
+  v4 mask =
+      v4_and(active, packet_hits_aabb(this->nodes[0].aabb, packet, hit->at,
+                                      &t_entry));
+  if (!movemask(mask)) return result;
+
+  for (;;) {
+    BVH_Node *node = this->nodes + node_id;
+    int lanes = movemask(mask);
+    if (lanes_diverged(lanes)) {
+      // Only one ray is left, so trace it alone through the subtree
+      int lane = 0;
+      while (!(lanes & (1 << lane))) ++lane;
+      Triangle_Hit lane_hit;
+      lane_hit.at = hit->at.E[lane];
+      int triangle_id;
+      if (this->intersect(packet_get_ray(packet, lane), &lane_hit,
+                          &triangle_id, node_id)) {
+        hit->at.E[lane] = lane_hit.at;
+        for (int i = 0; i < 3; ++i) {
+          hit->barycentric[i].E[lane] = lane_hit.barycentric[i];
+        }
+        hit->triangle_id[lane] = triangle_id;
+        result |= 1 << lane;
+      }
+    } else if (node->count > 0) {
+      for (int i = node->offset; i < node->offset + node->count; ++i) {
+        BVH_Triangle4 *block = this->triangle_blocks + i / kBlockSize;
+        v4 hit_mask =
+            packet_hits_triangle(packet, block, i % kBlockSize, mask, hit);
+        int hit_lanes = movemask(hit_mask);
+        if (hit_lanes == 0) continue;
+        for (int lane = 0; lane < 4; ++lane) {
+          if (hit_lanes & (1 << lane)) {
+            hit->triangle_id[lane] = this->primitive_ids[i];
+          }
+        }
+        result |= hit_lanes;
+      }
+    } else if (packet_visit_children(this->nodes, &node_id, packet, &mask,
+                                     hit->at, stack, stack_masks,
+                                     &stack_size)) {
+      continue;
+    }
+
+    if (!packet_pop_node(this->nodes, &node_id, packet, &mask, hit->at,
+                         stack, stack_masks, &stack_size)) {
+      break;
+    }
+  }
+
+  return result;
+}
+
+void BVH::destroy() {
+  sb_free(this->nodes);
+  sb_free(this->primitive_ids);
+  if (this->triangle_blocks) _mm_free(this->triangle_blocks);
+}
+
+void Instance_BVH::build(Model *scene_models) {
+  TIMED_BLOCK();
+
+  // Adding models can move the array while the scene is in use, so the
+  // scene has its own copy. It shares the geometry of the models
+  int count = sb_count(scene_models);
+  this->models = NULL;
+  for (int i = 0; i < count; ++i) sb_push(this->models, scene_models[i]);
+
+  // Instance bounds are the transformed bounds of the shared
+  // model space BVH, so the vertices are never touched here
+  AABBox *instance_aabbs = (AABBox *)malloc(count * sizeof(*instance_aabbs));
+  int *instance_ids = (int *)malloc(count * sizeof(*instance_ids));
+  int num_instances = 0;
+  for (int i = 0; i < count; ++i) {
+    Model *model = this->models + i;
+    if (!model->display || model->bvh->nodes == NULL) continue;
+
+    AABBox model_aabb = model->bvh->nodes[0].aabb;
+    m4x4 ModelTransform = model->get_transform_matrix();
+    v3 corners[8];
+    for (int corner = 0; corner < 8; ++corner) {
+      corners[corner].x = (corner & 1) ? model_aabb.max.x : model_aabb.min.x;
+      corners[corner].y = (corner & 2) ? model_aabb.max.y : model_aabb.min.y;
+      corners[corner].z = (corner & 4) ? model_aabb.max.z : model_aabb.min.z;
+    }
+    Matrix::transform_points(ModelTransform, corners, 8, corners);
+    AABBox aabb = aabb_empty();
+    for (int corner = 0; corner < 8; ++corner) {
+      aabb_grow(&aabb, corners[corner]);
+    }
+    instance_aabbs[num_instances] = aabb;
+    instance_ids[num_instances] = i;
+    num_instances++;
+  }
+
+  this->bvh.build_from_aabbs(instance_aabbs, num_instances, 1);
+
+  // Point leaves at the models rather than at the visible subset
+  for (int i = 0; i < num_instances; ++i) {
+    this->bvh.primitive_ids[i] = instance_ids[this->bvh.primitive_ids[i]];
+  }
+
+  free(instance_aabbs);
+  free(instance_ids);
+}
+
+bool Instance_BVH::intersect(Ray ray, Triangle_Hit *hit, int *model_id,
+                             int *triangle_id, int root) {
+  // Only hits closer than hit->at are reported
+  BVH_Node *nodes = this->bvh.nodes;
+  if (nodes == NULL) return false;
+
+  bool result = false;
+  v3 inv_direction = 1.0f / ray.direction;
+
+  int stack[BVH::kStackSize];
+  int stack_size = 0;
+  int node_id = root;
+
+  r32 t_entry;
+  if (!ray_hits_aabb(nodes[root].aabb, ray.origin, inv_direction, hit->at,
+                     &t_entry)) {
+    return false;
+  }
+
+  for (;;) {
+    BVH_Node *node = nodes + node_id;
+    if (node->count > 0) {
+      for (int i = 0; i < node->count; ++i) {
+        int id = this->bvh.primitive_ids[node->offset + i];
+        Model *model = this->models + id;
+        if (!model->display) continue;
+        if (model->hits(ray, hit, triangle_id)) {
+          *model_id = id;
+          result = true;
+        }
+      }
+    } else {
+      int child0 = node_id + 1;
+      int child1 = node->offset;
+      r32 t0, t1;
+      bool hit0 = ray_hits_aabb(nodes[child0].aabb, ray.origin,
+                                inv_direction, hit->at, &t0);
+      bool hit1 = ray_hits_aabb(nodes[child1].aabb, ray.origin,
+                                inv_direction, hit->at, &t1);
+      if (hit0 && hit1) {
+        if (t1 < t0) swap(child0, child1);
+        stack[stack_size++] = child1;
+        node_id = child0;
+        continue;
+      } else if (hit0) {
+        node_id = child0;
+        continue;
+      } else if (hit1) {
+        node_id = child1;
+        continue;
+      }
+    }
+
+    bool found = false;
+    while (stack_size > 0) {
+      node_id = stack[--stack_size];
+      if (ray_hits_aabb(nodes[node_id].aabb, ray.origin, inv_direction,
+                        hit->at, &t_entry)) {
+        found = true;
+        break;
+      }
+    }
+    if (!found) break;
+  }
+
+  return result;
+}
+
+int Instance_BVH::intersect_packet(Ray_Packet *packet, v4 active,
+                                   Packet_Hit *hit) {
+  // Returns the bit mask of lanes which found a closer hit
+  int result = 0;
+  BVH_Node *nodes = this->bvh.nodes;
+  if (nodes == NULL) return result;
+
+  int stack[BVH::kStackSize];
+  v4 stack_masks[BVH::kStackSize];
+  int stack_size = 0;
+  int node_id = 0;
+
+  v4 t_entry;
+  v4 mask =
+      v4_and(active, packet_hits_aabb(nodes[0].aabb, packet, hit->at,
+                                      &t_entry));
+  if (!movemask(mask)) return result;
+
+  for (;;) {
+    BVH_Node *node = nodes + node_id;
+    int lanes = movemask(mask);
+    if (lanes_diverged(lanes)) {
+      int lane = 0;
+      while (!(lanes & (1 << lane))) ++lane;
+      Triangle_Hit lane_hit;
+      lane_hit.at = hit->at.E[lane];
+      int model_id, triangle_id;
+      if (this->intersect(packet_get_ray(packet, lane), &lane_hit,
+                          &model_id, &triangle_id, node_id)) {
+        hit->at.E[lane] = lane_hit.at;
+        for (int i = 0; i < 3; ++i) {
+          hit->barycentric[i].E[lane] = lane_hit.barycentric[i];
+        }
+        hit->model_id[lane] = model_id;
+        hit->triangle_id[lane] = triangle_id;
+        result |= 1 << lane;
+      }
+    } else if (node->count > 0) {
+      for (int i = 0; i < node->count; ++i) {
+        int id = this->bvh.primitive_ids[node->offset + i];
+        Model *model = this->models + id;
+        if (!model->display) continue;
+        int hit_lanes = model->hits_packet(packet, mask, hit);
+        if (hit_lanes == 0) continue;
+        for (int lane = 0; lane < 4; ++lane) {
+          if (hit_lanes & (1 << lane)) hit->model_id[lane] = id;
+        }
+        result |= hit_lanes;
+      }
+    } else if (packet_visit_children(nodes, &node_id, packet, &mask,
+                                     hit->at, stack, stack_masks,
+                                     &stack_size)) {
+      continue;
+    }
+
+    if (!packet_pop_node(nodes, &node_id, packet, &mask, hit->at, stack,
+                         stack_masks, &stack_size)) {
+      break;
+    }
+  }
+
+  return result;
+}
+
+void Instance_BVH::destroy() {
+  this->bvh.destroy();
+  sb_free(this->models);
+  this->models = NULL;
+}
@@ -0,0 +1,70 @@
+#ifndef ED_BVH_H
+#define ED_BVH_H
+
+struct BVH_Node {
+  AABBox aabb;
+  // Interior nodes: index of the second child (the first child always
+  // follows its parent). Leaves: index of the first primitive id
+  int offset;
+  int count;  // number of primitives in a leaf, 0 for interior nodes
+};
+
+// Four triangles in SoA form for the SIMD intersection test, stored as
+// x, y and z rows with one lane per triangle. Unused lanes are zeroed
+struct BVH_Triangle4 {
+  r32 v0[3][4];
+  r32 edge1[3][4];  // v1 - v0
+  r32 edge2[3][4];  // v2 - v0
+};
+
+// Four rays traced together, one per lane
+struct Ray_Packet {
+  v4 origin[3];
+  v4 direction[3];
+  v4 inv_direction[3];
+};
+
+// Hits of a packet. Only hits closer than `at` are reported, so it
+// must be initialised by the caller (e.g. with INFINITY)
+struct Packet_Hit {
+  v4 at;
+  v4 barycentric[3];
+  int model_id[4];
+  int triangle_id[4];
+};
+
+struct BVH {
+  BVH_Node *nodes;
+  int *primitive_ids;  // triangle or instance indices ordered by leaves
+
+  // Precomputed triangles in the same order as primitive_ids (not used
+  // by the top level). Mesh leaves start at a multiple of 4 and the
+  // padding ids are -1, so leaf blocks are never shared
+  BVH_Triangle4 *triangle_blocks;
+
+  static const int kMaxLeafSize = 8;
+  static const int kNumBins = 16;
+  static const int kStackSize = 64;
+  static const int kBlockSize = 4;
+
+  void build(v3 *, Triangle *);
+  void build_from_aabbs(AABBox *, int, int);
+  bool intersect(Ray, Triangle_Hit *, int *, int root = 0);
+  int intersect_packet(Ray_Packet *, v4, Packet_Hit *);
+  void destroy();
+};
+
+// Top level structure over model instances. Copies of a model share
+// the bottom level BVH, and rays are transformed into model space
+// when they reach a leaf
+struct Instance_BVH {
+  BVH bvh;
+  Model *models;  // a copy of the scene's models
+
+  void build(Model *);
+  bool intersect(Ray, Triangle_Hit *, int *, int *, int root = 0);
+  int intersect_packet(Ray_Packet *, v4, Packet_Hit *);
+  void destroy();
+};
+
+#endif  // ED_BVH_H
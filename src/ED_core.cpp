@@ -10,158 +10,774 @@ void *Program_Memory::allocate(size_t size) {
   return result;
 }
 
-bool is_number_sym(int ch) {
-  return ('0' <= ch && ch <= '9') || ch == '-' || ch == '.';
+// One worker per core apart from the main thread, unless set with
+// --threads N on the command line or the ED_THREADS variable
+int choose_num_worker_threads(int argc, char **argv, int num_cores) {
+  int result = max(1, num_cores - 1);
+
+  char *env = getenv("ED_THREADS");
+  if (env != NULL && atoi(env) > 0) {
+    result = atoi(env);
+  }
+  for (int i = 1; i < argc - 1; ++i) {
+    if (strcmp(argv[i], "--threads") == 0 && atoi(argv[i + 1]) > 0) {
+      result = atoi(argv[i + 1]);
+    }
+  }
+
+  return result;
 }
 
-void Program_State::read_wavefront_obj_file(char *filename) {
-  FILE *f = fopen(filename, "rb");
-  if (f == NULL) {
-    printf("Can't open model file %s\n", filename);
-    exit(1);
+inline bool is_digit(char c) { return '0' <= c && c <= '9'; }
+
+inline bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+// Cursor over text which is not null-terminated, like a mapped file.
+// Nothing is copied, and lines can be of any length
+struct Text_Cursor {
+  char *at;
+  char *end;
+
+  bool at_line_end() { return this->at == this->end || *this->at == '\n'; }
+
+  char *line_end() {
+    char *result = (char *)memchr(this->at, '\n', this->end - this->at);
+    return result != NULL ? result : this->end;
   }
 
-  int num_models = 0;
+  void skip_line() {
+    char *next = this->line_end();
+    this->at = next < this->end ? next + 1 : next;
+  }
 
-  Model model = {};
-  model.set_defaults();
-  sprintf(model.name, "Model %d", num_models + 1);
+  void skip_spaces() {
+    while (this->at < this->end && is_space(*this->at)) ++this->at;
+  }
 
-  // Where indices start for each model
-  int v_start = 0;
-  int vn_start = 0;
-  int vt_start = 0;
-
-  const int kBufSize = 300;
-  char string[kBufSize];
-  while (fgets(string, kBufSize, f) != NULL) {
-    if (string[0] == 'o' && string[1] == ' ') {
-      if (model.triangles != NULL) {
-        // Push the model
-        sb_push(this->models, model);
-        ++num_models;
+  // Rest of the line without the spaces around it
+  char *rest_of_line(int *length) {
+    this->skip_spaces();
+    char *rest_end = this->line_end();
+    while (rest_end > this->at && is_space(rest_end[-1])) --rest_end;
+    *length = (int)(rest_end - this->at);
+    return this->at;
+  }
 
-        // Update indices for the next model
-        v_start += model.vertices ? sb_count(model.vertices) : 0;
-        vn_start += model.vns ? sb_count(model.vns) : 0;
-        vt_start += model.vts ? sb_count(model.vts) : 0;
+  // Skips the keyword if the line starts with it followed by a space
+  bool skip_keyword(const char *keyword) {
+    char *c = this->at;
+    for (; *keyword != '\0'; ++keyword, ++c) {
+      if (c == this->end || *c != *keyword) return false;
+    }
+    if (c == this->end || !is_space(*c)) return false;
+    this->at = c;
+    return true;
+  }
 
-        // Start a new one
-        model.set_defaults();
+  // Next word on the line, empty at the end of the line
+  char *next_word(int *length) {
+    this->skip_spaces();
+    char *word = this->at;
+    while (!this->at_line_end() && !is_space(*this->at)) ++this->at;
+    *length = (int)(this->at - word);
+    return word;
+  }
+
+  int count_words() {
+    int result = 0;
+    for (;;) {
+      this->skip_spaces();
+      if (this->at_line_end()) break;
+      ++result;
+      while (!this->at_line_end() && !is_space(*this->at)) ++this->at;
+    }
+    return result;
+  }
+
+  bool parse_int(int *);
+  bool parse_r32(r32 *);
+};
+
+bool Text_Cursor::parse_int(int *result) {
+  char *c = this->at;
+  bool negative = false;
+  if (c < this->end && (*c == '-' || *c == '+')) negative = (*c++ == '-');
+  if (c == this->end || !is_digit(*c)) return false;
+
+  int value = 0;
+  while (c < this->end && is_digit(*c)) value = value * 10 + (*c++ - '0');
+  *result = negative ? -value : value;
+  this->at = c;
+  return true;
+}
+
+// Skips the spaces before the number like sscanf. Digits go into an
+// integer and are scaled by a power of ten once at the end, which is
+// exact for the usual 6-9 significant digits
+bool Text_Cursor::parse_r32(r32 *result) {
+  local_persist const r64 kPowersOf10[] = {
+      1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+      1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+  const u64 kMaxMantissa = 100000000000000000ull;  // beyond a double
+
+  this->skip_spaces();
+  char *c = this->at;
+  bool negative = false;
+  if (c < this->end && (*c == '-' || *c == '+')) negative = (*c++ == '-');
+
+  u64 mantissa = 0;
+  int exponent = 0;
+  int num_digits = 0;
+  for (; c < this->end && is_digit(*c); ++c, ++num_digits) {
+    if (mantissa < kMaxMantissa) {
+      mantissa = mantissa * 10 + (*c - '0');
+    } else {
+      exponent++;  // digits beyond the precision of a double
+    }
+  }
+  if (c < this->end && *c == '.') {
+    for (++c; c < this->end && is_digit(*c); ++c, ++num_digits) {
+      if (mantissa < kMaxMantissa) {
+        mantissa = mantissa * 10 + (*c - '0');
+        exponent--;
       }
-      // Set model name
-      strncpy(model.name, string + 2, model.kMaxNameLength);
-      model.name[strlen(model.name) - 1] = '\0';
-    } else if (string[0] == 'f' && string[1] == ' ') {
-      // Face string - parse by hand
-      char number_string[kBufSize / 2];
-      const int kMaxIndices = 30;
-      int indices[kMaxIndices];
-      int num_indices = 0;
-      int ch = 0;
-      while (string[2 + ch] != '\n') {
-        int num_symbols = 0;
-        char c;
-        while (is_number_sym(c = string[2 + ch])) {
-          number_string[num_symbols++] = c;
-          ++ch;
+    }
+  }
+  if (num_digits == 0) return false;
+
+  if (c < this->end && (*c == 'e' || *c == 'E')) {
+    Text_Cursor exponent_cursor = {c + 1, this->end};
+    int value;
+    if (exponent_cursor.parse_int(&value)) {
+      exponent += value;
+      c = exponent_cursor.at;
+    }
+  }
+
+  r64 value = (r64)mantissa;
+  if (-22 <= exponent && exponent < 0) {
+    value /= kPowersOf10[-exponent];
+  } else if (0 < exponent && exponent <= 22) {
+    value *= kPowersOf10[exponent];
+  } else if (exponent != 0) {
+    value *= pow(10.0, exponent);
+  }
+  *result = (r32)(negative ? -value : value);
+  this->at = c;
+  return true;
+}
+
+// Parses v, v/vt, v//vn or v/vt/vn, and makes the indices start from 0.
+// Missing indices are -1
+bool parse_face_vertex(Text_Cursor *cursor, Vertex *vertex) {
+  vertex->vt_index = -1;
+  vertex->vn_index = -1;
+  if (!cursor->parse_int(&vertex->index)) return false;
+  vertex->index--;
+  if (!cursor->at_line_end() && *cursor->at == '/') {
+    ++cursor->at;
+    if (cursor->parse_int(&vertex->vt_index)) vertex->vt_index--;
+    if (!cursor->at_line_end() && *cursor->at == '/') {
+      ++cursor->at;
+      if (cursor->parse_int(&vertex->vn_index)) vertex->vn_index--;
+    }
+  }
+  return cursor->at_line_end() || is_space(*cursor->at);
+}
+
+// Numbers of elements in (a part of) an OBJ file
+struct Obj_Counts {
+  int positions;
+  int vts;
+  int vns;
+  int corners;
+};
+
+// A quick pass which only looks at the starts of the lines, apart from
+// the faces
+Obj_Counts count_obj_elements(Text_Cursor cursor) {
+  Obj_Counts result = {};
+  while (cursor.at < cursor.end) {
+    if (cursor.skip_keyword("f")) {
+      int num_vertices = cursor.count_words();
+      if (num_vertices >= 3) result.corners += 3 * (num_vertices - 2);
+    } else if (cursor.skip_keyword("v")) {
+      result.positions++;
+    } else if (cursor.skip_keyword("vt")) {
+      result.vts++;
+    } else if (cursor.skip_keyword("vn")) {
+      result.vns++;
+    }
+    cursor.skip_line();
+  }
+  return result;
+}
+
+// sb_push grows an array when it becomes full, hence one more. Empty
+// arrays are left NULL
+template <typename T>
+void reserve_for_pushes(T *&array, int count) {
+  if (count > 0) sb_reserve(array, count + 1);
+}
+
+enum Obj_Marker_Type {
+  Obj_Marker_Object = 0,  // o
+  Obj_Marker_Material,    // usemtl
+  Obj_Marker_Library,     // mtllib
+};
+
+// A line which names something, with the numbers of elements before it
+// in its chunk
+struct Obj_Marker {
+  Obj_Marker_Type type;
+  Obj_Counts counts;
+  char *name;  // in the file
+  int name_length;
+};
+
+// Part of the file between line boundaries, parsed on its own. Face
+// indices are kept as they are in the file, only starting from 0
+struct Obj_Chunk {
+  Text_Cursor text;
+  v3 *positions;
+  v2 *vts;
+  v3 *vns;
+  Vertex *corners;  // 3 per triangle
+  Obj_Marker *markers;
+  Obj_Counts offsets;  // of the elements of the chunk in the whole file
+};
+
+// Elements of the whole file, stitched together from the chunks. Or
+// of a part of the file, whose first elements are at base in the file
+struct Obj_File {
+  char *filename;
+  Obj_Chunk *chunks;
+  int num_chunks;
+  Obj_Counts base;
+
+  v3 *positions;
+  v2 *vts;
+  v3 *vns;
+  Vertex *corners;
+
+  // Model i is made of the elements from model_starts[i] to
+  // model_starts[i + 1]
+  Model *models;
+  Obj_Counts *model_starts;
+};
+
+struct Obj_Job {
+  Obj_File *file;
+  int index;
+};
+
+void parse_obj_chunk(Obj_File *file, Obj_Chunk *chunk) {
+  TIMED_BLOCK();
+
+  Obj_Counts counts = count_obj_elements(chunk->text);
+  reserve_for_pushes(chunk->positions, counts.positions);
+  reserve_for_pushes(chunk->vts, counts.vts);
+  reserve_for_pushes(chunk->vns, counts.vns);
+  reserve_for_pushes(chunk->corners, counts.corners);
+
+  Text_Cursor cursor = chunk->text;
+  while (cursor.at < cursor.end) {
+    char *line = cursor.at;
+    Obj_Marker marker;
+    bool is_marker = true;
+    if (cursor.skip_keyword("o")) {
+      marker.type = Obj_Marker_Object;
+    } else if (cursor.skip_keyword("usemtl")) {
+      marker.type = Obj_Marker_Material;
+    } else if (cursor.skip_keyword("mtllib")) {
+      marker.type = Obj_Marker_Library;
+    } else {
+      is_marker = false;
+    }
+    if (is_marker) {
+      marker.counts.positions = sb_count(chunk->positions);
+      marker.counts.vts = sb_count(chunk->vts);
+      marker.counts.vns = sb_count(chunk->vns);
+      marker.counts.corners = sb_count(chunk->corners);
+      marker.name = cursor.rest_of_line(&marker.name_length);
+      sb_push(chunk->markers, marker);
+    } else if (cursor.skip_keyword("f")) {
+      // Polygons are fanned out into triangles
+      Vertex first = {};
+      Vertex previous = {};
+      int num_vertices = 0;
+      bool valid = true;
+      for (;;) {
+        cursor.skip_spaces();
+        if (cursor.at_line_end()) break;
+        Vertex vertex;
+        if (!parse_face_vertex(&cursor, &vertex)) {
+          valid = false;
+          break;
         }
-        number_string[num_symbols] = '\0';
-        if (c != '\n') ++ch;
-
-        int parsed_index = -1;
-        if (num_symbols > 0) {
-          parsed_index = atoi(number_string) - 1;  // start from 0
-
-          // Substract the previous model indices
-          if (num_indices % 3 == 0) {
-            parsed_index -= v_start;
-          } else if (num_indices % 3 == 1) {
-            parsed_index -= vt_start;
-          } else if (num_indices % 3 == 2) {
-            parsed_index -= vn_start;
-          } else {
-            INVALID_CODE_PATH;
-          }
+        if (num_vertices == 0) {
+          first = vertex;
+        } else if (num_vertices >= 2) {
+          sb_push(chunk->corners, first);
+          sb_push(chunk->corners, previous);
+          sb_push(chunk->corners, vertex);
         }
-        indices[num_indices++] = parsed_index;
-        assert(num_indices <= kMaxIndices);
+        previous = vertex;
+        ++num_vertices;
       }
-      if (num_indices >= 9 && (num_indices % 3) == 0) {
-        Fan fan;
-        fan.num_vertices = num_indices / 3;
-        for (int i = 0; i < fan.num_vertices; ++i) {
-          fan.vertices[i].index = indices[3 * i];
-          fan.vertices[i].vt_index = indices[3 * i + 1];
-          fan.vertices[i].vn_index = indices[3 * i + 2];
-        }
-        int triangle_count = fan.num_vertices - 2;
-        for (int i = 0; i < triangle_count; ++i) {
-          Triangle triangle;
-          triangle.vertices[0] = fan.vertices[0];
-          triangle.vertices[1] = fan.vertices[1 + i];
-          triangle.vertices[2] = fan.vertices[2 + i];
-
-          sb_push(model.triangles, triangle);
-        }
-      } else {
-        printf("Unknown face definition in file %s, line \"%s\"\n", filename,
-               string);
+      if (!valid || num_vertices < 3) {
+        printf("Unknown face definition in file %s, line \"%.*s\"\n",
+               file->filename, (int)(cursor.line_end() - line), line);
         exit(1);
       }
-    } else if (string[0] == 'v' && string[1] == ' ') {
+    } else if (cursor.skip_keyword("v")) {
       // Vertex
-      v3 vertex;
-      sscanf(string + 2, "%f %f %f", &vertex.x, &vertex.y, &vertex.z);
-      sb_push(model.vertices, vertex);
-    } else if (string[0] == 'v' && string[1] == 't' && string[2] == ' ') {
+      v3 vertex = {};
+      cursor.parse_r32(&vertex.x);
+      cursor.parse_r32(&vertex.y);
+      cursor.parse_r32(&vertex.z);
+      sb_push(chunk->positions, vertex);
+    } else if (cursor.skip_keyword("vt")) {
       // Texture vertex
-      v2 vt;  // only expecting 2d textures
-      sscanf(string + 3, "%f %f", &vt.x, &vt.y);
-      sb_push(model.vts, vt);
-    } else if (string[0] == 'v' && string[1] == 'n' && string[2] == ' ') {
+      v2 vt = {};  // only expecting 2d textures
+      cursor.parse_r32(&vt.x);
+      cursor.parse_r32(&vt.y);
+      sb_push(chunk->vts, vt);
+    } else if (cursor.skip_keyword("vn")) {
       // Normal
-      v3 vn;
-      sscanf(string + 3, "%f %f %f", &vn.x, &vn.y, &vn.z);
-      sb_push(model.vns, vn);
+      v3 vn = {};
+      cursor.parse_r32(&vn.x);
+      cursor.parse_r32(&vn.y);
+      cursor.parse_r32(&vn.z);
+      sb_push(chunk->vns, vn);
     }
+    cursor.skip_line();
   }
+}
 
-  if (model.vertices != NULL) {
-    // sb_push(this->models, model);
-    {
-      assert(this->models == NULL);
-      // push model
-      int *p = (int *)realloc(0, sizeof(Model) + sizeof(int) * 2);
-      if (p) {
-        p[1] = 1;
-        p[0] = 1;
-        Model *result = (Model *)(p + 2);
-        *result = model;
-        this->models = result;
-      } else {
-        assert(!"vasia");
+template <typename T>
+void copy_chunk_array(T *destination, T *&array) {
+  if (array != NULL) memcpy(destination, array, sb_count(array) * sizeof(T));
+  sb_free(array);
+  array = NULL;
+}
+
+void parse_obj_chunk_job(void *data, int) {
+  Obj_Job *job = (Obj_Job *)data;
+  parse_obj_chunk(job->file, job->file->chunks + job->index);
+}
+
+void copy_obj_chunk_job(void *data, int) {
+  Obj_Job *job = (Obj_Job *)data;
+  Obj_File *file = job->file;
+  Obj_Chunk *chunk = file->chunks + job->index;
+  copy_chunk_array(file->positions + chunk->offsets.positions,
+                   chunk->positions);
+  copy_chunk_array(file->vts + chunk->offsets.vts, chunk->vts);
+  copy_chunk_array(file->vns + chunk->offsets.vns, chunk->vns);
+  copy_chunk_array(file->corners + chunk->offsets.corners, chunk->corners);
+}
+
+// Splits the text into chunks at line boundaries, which are parsed in
+// parallel and then copied one after another. Returns the numbers of
+// the elements
+Obj_Counts read_obj_elements(Obj_File *file, Text_Cursor text,
+                             Job_System *jobs) {
+  const size_t kMinChunkSize = 1024 * 1024;
+
+  size_t size = text.end - text.at;
+  file->num_chunks =
+      (int)min(size / kMinChunkSize + 1, (size_t)(4 * jobs->num_threads));
+  file->chunks = (Obj_Chunk *)calloc(file->num_chunks, sizeof(Obj_Chunk));
+  char *chunk_start = text.at;
+  for (int c = 0; c < file->num_chunks; ++c) {
+    Text_Cursor split = {chunk_start, text.end};
+    if (c < file->num_chunks - 1) {
+      split.at = max(split.at, text.at + size * (c + 1) / file->num_chunks);
+      if (split.at > chunk_start && split.at[-1] != '\n') split.skip_line();
+    } else {
+      split.at = text.end;
+    }
+    file->chunks[c].text.at = chunk_start;
+    file->chunks[c].text.end = split.at;
+    chunk_start = split.at;
+  }
+
+  Job_Group group;
+  Obj_Job job;
+  job.file = file;
+  for (int c = 0; c < file->num_chunks; ++c) {
+    job.index = c;
+    jobs->add(parse_obj_chunk_job, &job, sizeof(job), &group);
+  }
+  jobs->wait(&group);
+
+  Obj_Counts total = {};
+  for (int c = 0; c < file->num_chunks; ++c) {
+    Obj_Chunk *chunk = file->chunks + c;
+    chunk->offsets = total;
+    total.positions += sb_count(chunk->positions);
+    total.vts += sb_count(chunk->vts);
+    total.vns += sb_count(chunk->vns);
+    total.corners += sb_count(chunk->corners);
+  }
+  file->positions = (v3 *)malloc(total.positions * sizeof(v3));
+  file->vts = (v2 *)malloc(total.vts * sizeof(v2));
+  file->vns = (v3 *)malloc(total.vns * sizeof(v3));
+  file->corners = (Vertex *)malloc(total.corners * sizeof(Vertex));
+  for (int c = 0; c < file->num_chunks; ++c) {
+    job.index = c;
+    jobs->add(copy_obj_chunk_job, &job, sizeof(job), &group);
+  }
+  jobs->wait(&group);
+  return total;
+}
+
+void free_obj_file(Obj_File *file) {
+  for (int c = 0; c < file->num_chunks; ++c) {
+    sb_free(file->chunks[c].markers);
+  }
+  free(file->chunks);
+  free(file->positions);
+  free(file->vts);
+  free(file->vns);
+  free(file->corners);
+  sb_free(file->model_starts);
+}
+
+// Path of a file which is named relative to the directory of another
+void path_next_to(char *result, int size, char *file, char *name,
+                  int name_length) {
+  int directory_length = 0;
+  for (int i = 0; file[i] != '\0'; ++i) {
+    if (file[i] == '/' || file[i] == '\\') directory_length = i + 1;
+  }
+  snprintf(result, size, "%.*s%.*s", directory_length, file, name_length,
+           name);
+}
+
+// Only the diffuse texture of a material is used
+struct Obj_Material {
+  char name[Model::kMaxNameLength + 1];
+  Texture *texture;
+};
+
+// Materials of the libraries of an OBJ file, and the one in use
+struct Obj_Materials {
+  char *filename;  // of the OBJ file, the libraries are next to it
+  Texture_Cache *textures;
+  Obj_Material *materials;
+  Texture *current;
+  Mesh_Cache_Library *libraries;  // which the caches depend on
+
+  void read_library(char *, int);
+  void use(char *, int);
+};
+
+inline bool word_is(char *word, int length, const char *name) {
+  return (int)strlen(name) == length && memcmp(word, name, length) == 0;
+}
+
+// Skips the options before the file name of a texture map. The name is
+// the rest of the line, so that it can have spaces, which is why an
+// unknown option is taken as the start of the name
+void skip_mtl_map_options(Text_Cursor *cursor) {
+  local_persist const char *kOneArgument[] = {
+      "-blendu", "-blendv", "-bm",     "-boost",
+      "-cc",     "-clamp",  "-imfchan", "-texres"};
+  for (;;) {
+    cursor->skip_spaces();
+    if (cursor->at_line_end() || *cursor->at != '-') return;
+    Text_Cursor option_end = *cursor;
+    int length;
+    char *option = option_end.next_word(&length);
+    int num_arguments = 0;
+    int num_numbers = 0;  // up to how many numbers follow
+    if (word_is(option, length, "-mm")) {
+      num_arguments = 2;
+    } else if (word_is(option, length, "-o") ||
+               word_is(option, length, "-s") ||
+               word_is(option, length, "-t")) {
+      num_numbers = 3;
+    } else {
+      for (size_t i = 0; i < COUNT_OF(kOneArgument); ++i) {
+        if (word_is(option, length, kOneArgument[i])) num_arguments = 1;
       }
+      if (num_arguments == 0) return;
     }
-    num_models++;
+    *cursor = option_end;
+
+    for (int i = 0; i < num_arguments; ++i) cursor->next_word(&length);
+    for (int i = 0; i < num_numbers; ++i) {
+      Text_Cursor word_end = *cursor;
+      char *word = word_end.next_word(&length);
+      Text_Cursor number = {word, word + length};
+      r32 value;
+      if (length == 0 || !number.parse_r32(&value) || number.at != number.end) {
+        break;
+      }
+      *cursor = word_end;
+    }
+  }
+}
+
+void Obj_Materials::read_library(char *name, int name_length) {
+  char path[1024];
+  path_next_to(path, sizeof(path), this->filename, name, name_length);
+  Mapped_File file;
+  if (!file.map(path)) {
+    printf("Can't open material library %s\n", path);
+    add_mesh_cache_library(&this->libraries, path, NULL);
+    return;
+  }
+  add_mesh_cache_library(&this->libraries, path, &file);
+
+  Text_Cursor cursor = {file.data, file.data + file.size};
+  while (cursor.at < cursor.end) {
+    cursor.skip_spaces();
+    int length;
+    if (cursor.skip_keyword("newmtl")) {
+      Obj_Material material = {};
+      char *material_name = cursor.rest_of_line(&length);
+      length = min(length, (int)Model::kMaxNameLength);
+      memcpy(material.name, material_name, length);
+      sb_push(this->materials, material);
+    } else if (cursor.skip_keyword("map_Kd") && this->materials != NULL) {
+      skip_mtl_map_options(&cursor);
+      char *image = cursor.rest_of_line(&length);
+      char image_path[1024];
+      path_next_to(image_path, sizeof(image_path), path, image, length);
+      sb_last(this->materials).texture = this->textures->request(image_path);
+    }
+    cursor.skip_line();
+  }
+  file.unmap();
+}
+
+// Unknown materials are untextured
+void Obj_Materials::use(char *name, int name_length) {
+  this->current = NULL;
+  for (int i = 0; i < sb_count(this->materials); ++i) {
+    Obj_Material *material = this->materials + i;
+    if ((int)strlen(material->name) == name_length &&
+        memcmp(material->name, name, name_length) == 0) {
+      this->current = material->texture;
+    }
+  }
+}
+
+void apply_obj_marker(Obj_Marker *marker, Model *model,
+                      Obj_Materials *materials) {
+  if (marker->type == Obj_Marker_Object) {
+    int name_length = min(marker->name_length, (int)model->kMaxNameLength);
+    memcpy(model->name, marker->name, name_length);
+    model->name[name_length] = '\0';
+  } else if (marker->type == Obj_Marker_Material) {
+    materials->use(marker->name, marker->name_length);
+  } else if (marker->type == Obj_Marker_Library) {
+    materials->read_library(marker->name, marker->name_length);
+  }
+}
+
+// Gives every distinct combination of position, texture and normal
+// indices its own vertex, so that all vertex data is indexed the same
+// way and vertices shared between triangles are only transformed once
+void make_indexed_mesh(Model *model, v3 *positions, v2 *vts, v3 *vns,
+                       Vertex *corners, int num_corners) {
+  int table_size = 16;
+  while (table_size < 2 * num_corners) table_size *= 2;
+  int *table = (int *)malloc(table_size * sizeof(int));
+  for (int i = 0; i < table_size; ++i) table[i] = -1;
+
+  Vertex *unique = NULL;
+  sb_add(model->triangles, num_corners / 3);
+  for (int i = 0; i < num_corners; ++i) {
+    Vertex corner = corners[i];
+    u32 hash = (u32)corner.index * 73856093u ^
+               (u32)corner.vt_index * 19349663u ^
+               (u32)corner.vn_index * 83492791u;
+    int slot = hash & (table_size - 1);
+    while (table[slot] >= 0) {
+      Vertex other = unique[table[slot]];
+      if (other.index == corner.index && other.vt_index == corner.vt_index &&
+          other.vn_index == corner.vn_index) {
+        break;
+      }
+      slot = (slot + 1) & (table_size - 1);
+    }
+    if (table[slot] < 0) {
+      table[slot] = sb_count(unique);
+      sb_push(unique, corner);
+      sb_push(model->vertices, positions[corner.index]);
+      // Missing texture coordinates and normals are left at zero
+      sb_push(model->vts,
+              corner.vt_index >= 0 ? vts[corner.vt_index] : V2(0, 0));
+      sb_push(model->vns,
+              corner.vn_index >= 0 ? vns[corner.vn_index] : V3(0, 0, 0));
+    }
+    model->triangles[i / 3].indices[i % 3] = table[slot];
+  }
+
+  sb_free(unique);
+  free(table);
+}
+
+// Moves the model to the center of its mesh, which becomes the origin
+// of the model space
+void center_and_build_bvh(Model *model) {
+  // Find AABB and reposition the model
+  model->position = V3(0, 0, 0);
+  model->update_aabb(false);  // not rotated
+  model->position = (model->aabb.min + model->aabb.max) * 0.5f;
+  for (int j = 0; j < sb_count(model->vertices); ++j) {
+    model->vertices[j] -= model->position;
+  }
+
+  // Build the acceleration structure for ray tracing in model space
+  model->bvh = (BVH *)malloc(sizeof(*model->bvh));
+  model->bvh->build(model->vertices, model->triangles);
+}
+
+// Makes the mesh of a model out of the elements of the file from start
+// to end. The indices of the faces are rebased to the first elements of
+// the model
+void make_obj_mesh(Model *model, Obj_File *file, Obj_Counts start,
+                   Obj_Counts end) {
+  Vertex *corners = file->corners + start.corners;
+  int num_corners = end.corners - start.corners;
+  int first_position = file->base.positions + start.positions;
+  int first_vt = file->base.vts + start.vts;
+  int first_vn = file->base.vns + start.vns;
+  for (int i = 0; i < num_corners; ++i) {
+    corners[i].index -= first_position;
+    if (corners[i].vt_index >= 0) corners[i].vt_index -= first_vt;
+    if (corners[i].vn_index >= 0) corners[i].vn_index -= first_vn;
+  }
+  make_indexed_mesh(model, file->positions + start.positions,
+                    file->vts + start.vts, file->vns + start.vns, corners,
+                    num_corners);
+}
+
+void make_obj_model(Model *model, Obj_File *file, Obj_Counts start,
+                    Obj_Counts end) {
+  make_obj_mesh(model, file, start, end);
+  center_and_build_bvh(model);
+}
+
+void make_obj_model_job(void *data, int) {
+  Obj_Job *job = (Obj_Job *)data;
+  Obj_File *file = job->file;
+  make_obj_model(file->models + job->index, file,
+                 file->model_starts[job->index],
+                 file->model_starts[job->index + 1]);
+}
+
+// Files bigger than the memory budget are streamed. Models of the
+// others come from the mesh cache of the file if it's up to date.
+// Otherwise the file is split into chunks at line boundaries, which are
+// parsed in parallel and then copied one after another. Objects can
+// span chunks, so they are only found after that, and then made in
+// parallel too. The cache is saved for the next time
+void Program_State::read_wavefront_obj_file(char *filename) {
+  Mapped_File mapped_file;
+  if (!mapped_file.map(filename)) {
+    printf("Can't open model file %s\n", filename);
+    exit(1);
   }
 
-  // Find AABB and reposition the models
-  for (int i = 0; i < sb_count(this->models); ++i) {
-    Model *m = this->models + i;
-    m->position = V3(0, 0, 0);
-    m->update_aabb(false);  // not rotated
-    m->position = (m->aabb.min + m->aabb.max) * 0.5f;
-    for (int j = 0; j < sb_count(m->vertices); ++j) {
-      m->vertices[j] -= m->position;
+  if (mapped_file.size > Mesh_Stream::kDefaultBudget) {
+    this->open_mesh_stream(filename, &mapped_file);
+    mapped_file.unmap();
+    return;
+  }
+
+  char cache_name[1024];
+  snprintf(cache_name, sizeof(cache_name), "%s" MESH_CACHE_EXTENSION,
+           filename);
+  Mapped_File cache;
+  if (load_mesh_cache(cache_name, &mapped_file, &cache, &this->models,
+                      this->textures)) {
+    sb_push(this->mesh_caches, cache);
+    mapped_file.unmap();
+    Job_Group group;
+    this->textures->load_requested(this->jobs, &group);
+    this->jobs->wait(&group);
+    return;
+  }
+
+  Obj_File file = {};
+  file.filename = filename;
+  Text_Cursor text = {mapped_file.data, mapped_file.data + mapped_file.size};
+  Obj_Counts total = read_obj_elements(&file, text, this->jobs);
+
+  Job_Group group;
+  Obj_Job job;
+  job.file = &file;
+  int first_model = sb_count(this->models);
+  int num_models = 0;
+
+  Model model = {};
+  model.set_defaults();
+  sprintf(model.name, "Model %d", num_models + 1);
+
+  Obj_Materials materials = {};
+  materials.filename = filename;
+  materials.textures = this->textures;
+
+  // Where the elements of the current model start in the file
+  Obj_Counts start = {};
+  sb_push(file.model_starts, start);
+
+  for (int c = 0; c < file.num_chunks; ++c) {
+    Obj_Chunk *chunk = file.chunks + c;
+    for (int m = 0; m < sb_count(chunk->markers); ++m) {
+      Obj_Marker *marker = chunk->markers + m;
+      Obj_Counts at = marker->counts;
+      at.positions += chunk->offsets.positions;
+      at.vts += chunk->offsets.vts;
+      at.vns += chunk->offsets.vns;
+      at.corners += chunk->offsets.corners;
+      // Every model has one material
+      if (marker->type != Obj_Marker_Library && at.corners > start.corners) {
+        // Push the model and start a new one
+        model.texture = materials.current;
+        sb_push(this->models, model);
+        sb_push(file.model_starts, at);
+        ++num_models;
+        model.set_defaults();
+        start = at;
+      }
+      apply_obj_marker(marker, &model, &materials);
     }
   }
 
-  fclose(f);
+  if (total.corners > start.corners) {
+    model.texture = materials.current;
+    sb_push(file.model_starts, total);
+    sb_push(this->models, model);
+    num_models++;
+  }
+
+  // Textures are decoded while the models are made
+  file.models = this->models + first_model;
+  for (int i = 0; i < num_models; ++i) {
+    job.index = i;
+    this->jobs->add(make_obj_model_job, &job, sizeof(job), &group);
+  }
+  this->textures->load_requested(this->jobs, &group);
+  this->jobs->wait(&group);
+  save_mesh_cache(cache_name, &mapped_file, file.models, num_models,
+                  materials.libraries);
+
+  free_obj_file(&file);
+  sb_free(materials.materials);
+  sb_free(materials.libraries);
+
+  mapped_file.unmap();
 }
 
 void Program_State::init(Program_Memory *memory, Pixel_Buffer *buffer,
-                         Raytrace_Work_Queue *queue) {
+                         Job_System *job_system) {
   Program_State *state = this;
 
   g_FPS.value = 0;
@@ -177,10 +793,10 @@ void Program_State::init(Program_Memory *memory, Pixel_Buffer *buffer,
   state->UI->memory = memory;
   state->UI->buffer = buffer;
 
-  state->raytrace_queue = queue;
-  for (int i = 0; i < g_kNumThreads; ++i) {
-    state->raytrace_queue->entries_in_progress[i] = -1;
-  }
+  state->jobs = job_system;
+  state->rasterizer = (Rasterizer *)calloc(1, sizeof(*state->rasterizer));
+  state->rasterizer->init();
+  state->textures = (Texture_Cache *)calloc(1, sizeof(*state->textures));
 
   // Allocate memory for the main buffer
   buffer->allocate();
@@ -202,17 +818,14 @@ void Program_State::init(Program_Memory *memory, Pixel_Buffer *buffer,
   // on windows using C++11 struct initializers
   state->models = NULL;
   state->selected_model = NULL;
+  state->mesh_caches = NULL;
+  state->mesh_streams = NULL;
 
   this->read_wavefront_obj_file("../models/african_head/african_head.wobj");
   // this->read_wavefront_obj_file("../models/teapot/teapot.wobj");
   // this->read_wavefront_obj_file("../models/cube/cube.wobj");
   // this->read_wavefront_obj_file("../models/test.wobj");
   // this->read_wavefront_obj_file("../models/culdesac/geometricCuldesac.wobj");
-
-  Model *model = &state->models[0];
-  model->read_texture("../models/african_head/african_head_diffuse.jpg");
-  // model->read_texture("../models/cube/cube.png");
-
 }
 
 void ED_Font::load_from_file(char *filename, int char_height) {
@@ -297,6 +910,7 @@ Update_Result update_and_render(Program_Memory *program_memory,
     }
   }
 
+  update_mesh_streams(state);
   result = state->UI->update_and_draw(input, state);
 
   return result;
@@ -85,6 +85,17 @@ struct Image {
   void load_from_file(char *);
 };
 
+// Read-only view of a whole file, the data is not null-terminated.
+// Implemented by the platform layer
+struct Mapped_File {
+  char *data;
+  size_t size;
+  u64 modified_time;  // in units of the platform
+
+  bool map(char *);
+  void unmap();
+};
+
 struct Pixel_Buffer {
   int width;
   int height;
@@ -115,14 +126,18 @@ struct Update_Result {
   Cursor_Type cursor;
 };
 
-struct Raytrace_Work_Queue;
+struct Job_System;
+struct Rasterizer;
+struct Mesh_Stream;
+struct Texture_Cache;
 
 struct thread_info {
   int thread_num;
 };
 
-const int g_kNumThreads = 4;
-thread_info g_threads[g_kNumThreads];
+// Chosen at startup, see choose_num_worker_threads
+int g_num_worker_threads;
+thread_info *g_threads;
 
 struct Program_State {
   int kWindowWidth;
@@ -139,10 +154,15 @@ struct Program_State {
 
   Image icons;
 
-  Raytrace_Work_Queue *raytrace_queue = NULL;
+  Job_System *jobs = NULL;
+  Rasterizer *rasterizer = NULL;  // shared by the 3D views
+  Mapped_File *mesh_caches = NULL;  // used by the models loaded from them
+  Mesh_Stream **mesh_streams = NULL;
+  Texture_Cache *textures = NULL;  // shared by all the models
 
-  void init(Program_Memory *, Pixel_Buffer *, Raytrace_Work_Queue *);
+  void init(Program_Memory *, Pixel_Buffer *, Job_System *);
   void read_wavefront_obj_file(char *);
+  void open_mesh_stream(char *, Mapped_File *);
 };
 
 struct ED_Font_Codepoint {
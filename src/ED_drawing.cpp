@@ -156,151 +156,441 @@ bool is_top_left(v2i vert0, v2i vert1) {
   return false;
 }
 
-struct Triangle_Edge {
-  v4 step_x;
-  v4 step_y;
-
-  v4 init(v2, v2, v2);
-  void adjust_step(v4);
+// Edge functions scaled so that they give the barycentric coordinates,
+// w[i] = a[i] * x + b[i] * y + c[i] in area coordinates. w[0] is
+// the weight of verts[0] and so on
+struct Raster_Edges {
+  r32 a[3];
+  r32 b[3];
+  r32 c[3];
+
+  // Smallest and largest change of w over the pixels of a block
+  r32 block_min[3];
+  r32 block_max[3];
+
+  bool init(v3[]);
 };
 
-v4 Triangle_Edge::init(v2 vert0, v2 vert1, v2 origin) {
-  r32 A = vert0.y - vert1.y;
-  r32 B = vert1.x - vert0.x;
-  r32 C = vert0.x * vert1.y - vert0.y * vert1.x;
+bool Raster_Edges::init(v3 verts[]) {
+  for (int i = 0; i < 3; ++i) {
+    v3 vert0 = verts[(i + 1) % 3];
+    v3 vert1 = verts[(i + 2) % 3];
+    this->a[i] = vert0.y - vert1.y;
+    this->b[i] = vert1.x - vert0.x;
+    this->c[i] = vert0.x * vert1.y - vert0.y * vert1.x;
+  }
 
-  this->step_x = v4(A * 4);
-  this->step_y = v4(B * 1);
+  // The sum of the edge functions is the same everywhere
+  r32 denom = this->c[0] + this->c[1] + this->c[2];
+  if (denom == 0) return false;  // degenerate
+  r32 inv_denom = 1.0f / denom;
 
-  // x, y values for initial pixel block
-  v4 x = v4(origin.x) + v4(0, 1, 2, 3);
-  v4 y = v4(origin.y);
+  r32 last = (r32)(Raster_Tile::kBlockSize - 1);
+  for (int i = 0; i < 3; ++i) {
+    this->a[i] *= inv_denom;
+    this->b[i] *= inv_denom;
+    this->c[i] *= inv_denom;
+    r32 dx = this->a[i] * last;
+    r32 dy = this->b[i] * last;
+    this->block_min[i] = min(dx, 0.0f) + min(dy, 0.0f);
+    this->block_max[i] = max(dx, 0.0f) + max(dy, 0.0f);
+  }
+  return true;
+}
+
+enum Block_Coverage {
+  Block_Coverage_Outside = 0,
+  Block_Coverage_Partial,
+  Block_Coverage_Inside,
+};
 
-  v4 w_row = v4(A) * x + v4(B) * y + v4(C);
-  return w_row;
+// The edge functions are linear, so their values in the corners
+// of a block tell if the triangle covers all, some or none of it.
+// (x0, y0) is the bottom left pixel. Inline so that the AVX2 path
+// doesn't switch to SSE code for every block
+inline Block_Coverage classify_block(Raster_Edges *edges, r32 x0, r32 y0) {
+  Block_Coverage result = Block_Coverage_Inside;
+  for (int i = 0; i < 3; ++i) {
+    r32 w = edges->a[i] * x0 + edges->b[i] * y0 + edges->c[i];
+    if (w + edges->block_max[i] < 0) return Block_Coverage_Outside;
+    if (w + edges->block_min[i] < 0) result = Block_Coverage_Partial;
+  }
+  return result;
+}
+
+// Blocks of the tile covered by the bounding box of a triangle
+struct Raster_Bounds {
+  v2i block_min;  // top left block
+  v2i block_max;
+  r32 max_z;  // nearest depth of the triangle
+};
+
+// Returns false if there's nothing to draw, including when
+// the triangle is behind all blocks
+bool get_raster_bounds(Raster_Tile *tile, v3 verts[], Raster_Bounds *bounds) {
+  // Compute BB and align to integer grid
+  r32 min_x = floor_r32(min3(verts[0].x, verts[1].x, verts[2].x));
+  r32 min_y = floor_r32(min3(verts[0].y, verts[1].y, verts[2].y));
+  r32 max_x = floor_r32(max3(verts[0].x, verts[1].x, verts[2].x));
+  r32 max_y = floor_r32(max3(verts[0].y, verts[1].y, verts[2].y));
+
+  // Clip against tile bounds
+  min_x = max(min_x, (r32)tile->origin.x);
+  min_y = max(min_y, (r32)tile->origin.y);
+  max_x = min(max_x, (r32)(tile->origin.x + tile->width - 1));
+  max_y = min(max_y, (r32)(tile->origin.y + tile->height - 1));
+  if (min_x > max_x || min_y > max_y) return false;
+
+  // Rows in the tile go from top to bottom
+  int block_size = Raster_Tile::kBlockSize;
+  bounds->block_min =
+      V2i(((int)min_x - tile->origin.x) / block_size,
+          (tile->height - 1 - ((int)max_y - tile->origin.y)) / block_size);
+  bounds->block_max =
+      V2i(((int)max_x - tile->origin.x) / block_size,
+          (tile->height - 1 - ((int)min_y - tile->origin.y)) / block_size);
+  bounds->max_z = max3(verts[0].z, verts[1].z, verts[2].z);
+
+  for (int y = bounds->block_min.y; y <= bounds->block_max.y; ++y) {
+    r32 *block_depth = tile->block_min_depth + y * Raster_Tile::kBlocks;
+    for (int x = bounds->block_min.x; x <= bounds->block_max.x; ++x) {
+      if (bounds->max_z >= block_depth[x]) return true;
+    }
+  }
+  return false;
 }
 
-void Triangle_Edge::adjust_step(v4 inv_denom) {
-  this->step_x *= inv_denom;
-  this->step_y *= inv_denom;
+// Texture coordinates in texels divided by w, and 1/w, which are linear
+// in screen space. Dividing their interpolated values gives perspective
+// correct coordinates
+struct Raster_Texturing {
+  Texture *texture;
+  Raster_Edges *triangle_edges;
+  r32 inv_w[3];
+  r32 s_w[3];
+  r32 t_w[3];
+  r32 inv_w_dx, inv_w_dy;
+  r32 s_w_dx, s_w_dy;
+  r32 t_w_dx, t_w_dy;
+
+  void init(Raster_Triangle *, Raster_Edges *);
+  r32 get_lod(r32, r32);
+};
+
+void Raster_Texturing::init(Raster_Triangle *triangle, Raster_Edges *edges) {
+  this->texture = triangle->texture;
+  this->triangle_edges = edges;
+  r32 width = (r32)this->texture->width;
+  r32 height = (r32)this->texture->height;
+  this->inv_w_dx = this->inv_w_dy = 0;
+  this->s_w_dx = this->s_w_dy = 0;
+  this->t_w_dx = this->t_w_dy = 0;
+  for (int i = 0; i < 3; ++i) {
+    this->inv_w[i] = triangle->inv_w[i];
+    this->s_w[i] = triangle->uv[i].u * width * triangle->inv_w[i];
+    this->t_w[i] = (1.0f - triangle->uv[i].v) * height * triangle->inv_w[i];
+
+    // The normalized edge functions are the barycentric coordinates
+    this->inv_w_dx += edges->a[i] * this->inv_w[i];
+    this->inv_w_dy += edges->b[i] * this->inv_w[i];
+    this->s_w_dx += edges->a[i] * this->s_w[i];
+    this->s_w_dy += edges->b[i] * this->s_w[i];
+    this->t_w_dx += edges->a[i] * this->t_w[i];
+    this->t_w_dy += edges->b[i] * this->t_w[i];
+  }
 }
 
-void triangle_rasterize_simd(Area *area, v3 verts[], v3 vns[], r32 *z_buffer,
-                             v3 light_dir, bool outline = false) {
-  TIMED_BLOCK();
+// Level of detail at a point, from the longer of the texel steps in x
+// and y. The derivative of s = (s/w) / (1/w) is (d(s/w) - s * d(1/w)) * w.
+// Used for whole blocks, so that the texture lookups share one level
+inline r32 Raster_Texturing::get_lod(r32 x, r32 y) {
+  Raster_Edges *edges = this->triangle_edges;
+  r32 one_over_w = 0, s = 0, t = 0;
+  for (int i = 0; i < 3; ++i) {
+    r32 weight = edges->a[i] * x + edges->b[i] * y + edges->c[i];
+    one_over_w += weight * this->inv_w[i];
+    s += weight * this->s_w[i];
+    t += weight * this->t_w[i];
+  }
+  r32 w = 1.0f / one_over_w;
+  s *= w;
+  t *= w;
+  r32 ds_dx = (this->s_w_dx - s * this->inv_w_dx) * w;
+  r32 dt_dx = (this->t_w_dx - t * this->inv_w_dx) * w;
+  r32 ds_dy = (this->s_w_dy - s * this->inv_w_dy) * w;
+  r32 dt_dy = (this->t_w_dy - t * this->inv_w_dy) * w;
+  r32 footprint =
+      max(ds_dx * ds_dx + dt_dx * dt_dx, ds_dy * ds_dy + dt_dy * dt_dy);
+  return 0.5f * log2f(footprint);
+}
 
-  Pixel_Buffer *buffer = area->buffer;
+// Texture colors at 4 pixels with barycentric coordinates w0, w1, w2,
+// multiplied by the light
+inline v4i texture_color(Raster_Texturing *tex, v4 w0, v4 w1, v4 w2,
+                         v4 light, r32 lod) {
+  v4 inv_w = w0 * v4(tex->inv_w[0]) + w1 * v4(tex->inv_w[1]) +
+             w2 * v4(tex->inv_w[2]);
+  v4 w = v4(1.0f) / inv_w;
+  v4 s = (w0 * v4(tex->s_w[0]) + w1 * v4(tex->s_w[1]) +
+          w2 * v4(tex->s_w[2])) * w;
+  v4 t = (w0 * v4(tex->t_w[0]) + w1 * v4(tex->t_w[1]) +
+          w2 * v4(tex->t_w[2])) * w;
+  return modulate(tex->texture->sample(s, t, lod), light);
+}
 
-  v2 vert0 = V2(verts[0]);
-  v2 vert1 = V2(verts[1]);
-  v2 vert2 = V2(verts[2]);
+ED_AVX2 inline v8i texture_color(Raster_Texturing *tex, v8 w0, v8 w1, v8 w2,
+                                 v8 light, r32 lod) {
+  v8 inv_w = w0 * v8(tex->inv_w[0]) + w1 * v8(tex->inv_w[1]) +
+             w2 * v8(tex->inv_w[2]);
+  v8 w = v8(1.0f) / inv_w;
+  v8 s = (w0 * v8(tex->s_w[0]) + w1 * v8(tex->s_w[1]) +
+          w2 * v8(tex->s_w[2])) * w;
+  v8 t = (w0 * v8(tex->t_w[0]) + w1 * v8(tex->t_w[1]) +
+          w2 * v8(tex->t_w[2])) * w;
+  return modulate(tex->texture->sample(s, t, lod), light);
+}
 
-  // Compute BB and align to integer grid
-  r32 min_x = floor_r32(min3(vert0.x, vert1.x, vert2.x));
-  r32 min_y = floor_r32(min3(vert0.y, vert1.y, vert2.y));
-  r32 max_x = floor_r32(max3(vert0.x, vert1.x, vert2.x));
-  r32 max_y = floor_r32(max3(vert0.y, vert1.y, vert2.y));
+// Draws a triangle in area coordinates into the part of it which
+// overlaps the tile. Goes over the 8x8 blocks of the bounding box and
+// only tests the pixels against the edges in partially covered blocks.
+// Textured triangles are lit like in the ray tracer, the others are grey
+template <bool kTextured>
+void triangle_rasterize_simd(Raster_Tile *tile, Raster_Triangle *triangle) {
+  TIMED_BLOCK();
 
-  // Clip against area bounds
-  min_x = max(min_x, 0.0f);
-  min_y = max(min_y, 0.0f);
-  max_x = min(max_x, (r32)(area->get_width() - 1));
-  max_y = min(max_y, (r32)(area->get_height() - 1));
+  v3 *verts = triangle->verts;
+  Raster_Bounds bounds;
+  if (!get_raster_bounds(tile, verts, &bounds)) return;
+  Raster_Edges edges;
+  if (!edges.init(verts)) return;
+  Raster_Texturing texturing;
+  if (kTextured) texturing.init(triangle, &edges);
 
   // Triangle setup
-  v2 origin = V2(min_x, min_y);
-  Triangle_Edge e01, e12, e20;
-  v4 w0_row = e12.init(vert1, vert2, origin);
-  v4 w1_row = e20.init(vert2, vert0, origin);
-  v4 w2_row = e01.init(vert0, vert1, origin);
+  v4 step_x[3], step_y[3];
+  for (int i = 0; i < 3; ++i) {
+    step_x[i] = v4(edges.a[i] * 4);
+    step_y[i] = v4(edges.b[i]);
+  }
   v4 z0 = v4(verts[0].z);
   v4 z1 = v4(verts[1].z);
   v4 z2 = v4(verts[2].z);
 
-  // Normalise barycentric coordinates
-  v4 inv_denom = v4(1.0f) / (w0_row + w1_row + w2_row);
-  w0_row *= inv_denom;
-  w1_row *= inv_denom;
-  w2_row *= inv_denom;
-  e01.adjust_step(inv_denom);
-  e12.adjust_step(inv_denom);
-  e20.adjust_step(inv_denom);
-
-  // Calculate intensity at vertices for Gouraud shading
-  light_dir = light_dir.normalized();
   v4 in[3];
   for (int i = 0; i < 3; ++i) {
-    in[i] = v4(-vns[i].normalized() * light_dir);
+    in[i] = v4(triangle->intensity[i]);
   }
 
-  // Real pixel start and end coords
-  v2i p_min = V2i(area->left + (int)min_x,
-                  buffer->height - (int)max_y - area->bottom - 1);
-  v2i p_max = V2i(area->left + (int)max_x,
-                  buffer->height - (int)min_y - area->bottom - 1);
-
   v4 zero = v4::zero();
+  v4i all_lanes = v4i(-1);
+  v4 lane_x = v4(0, 1, 2, 3);
 
-  v4i buffer_width_wide = v4i(buffer->width);
-  v4i x_step_wide = v4i(4);
-  v4 max_intensity = v4(220.0f);
-  v4 min_intensity = v4(40.0f);
-
-  int pitch = buffer->width;
-  u32 *pixel_row = (u32 *)buffer->memory + p_max.y * pitch;
-  r32 *z_buffer_row = z_buffer + p_max.y * pitch;
+  v4 max_intensity = kTextured ? v4(1.0f) : v4(220.0f);
+  v4 min_intensity = kTextured ? v4(0.2f) : v4(40.0f);
+  int pitch = Raster_Tile::kSize;
+  int block_size = Raster_Tile::kBlockSize;
+  u64 touched_blocks = 0;  // where the depth has changed
+  int num_blocks = 0;
 
   TIME_BEGIN(rasterization);
-  // Rasterize
-  for (int y = p_max.y; y >= p_min.y; y -= 1) {
-    // Barycentric coordinates at start of row
-    v4 w0 = w0_row;
-    v4 w1 = w1_row;
-    v4 w2 = w2_row;
-    v4i x_wide = v4i(p_min.x) + v4i(0, 1, 2, 3);
-
-    for (int x = p_min.x; x <= p_max.x; x += 4) {
-      // If point is on or inside all edges for any pixels, render those pixels
-      v4i mask =
-          float2bits(v4_and(cmpge(w0, zero), cmpge(w1, zero), cmpge(w2, zero)));
-      mask &= cmplt(x_wide, buffer_width_wide);
-
-      if (mask_not_zero(mask)) {
-        v4 intensity = w0 * in[0] + w1 * in[1] + w2 * in[2];
-        intensity = v4_and(intensity, cmpge(intensity, zero));
-        v4i grey_ch = ftoi(v4_lerp(intensity, min_intensity, max_intensity));
-        v4i grey = (shiftl<24>(grey_ch) | shiftl<16>(grey_ch) |
-                    shiftl<8>(grey_ch) | grey_ch);
-
-        v4 z_values = w0 * z0 + w1 * z1 + w2 * z2;
-        v4 z_buffer_values = v4::loadu(z_buffer_row + x);
-        v4 z_mask = v4_and(bits2float(mask), cmpge(z_values, z_buffer_values));
-        v4 new_z_values =
-            v4_or(v4_and(z_mask, z_values), v4_andnot(z_mask, z_buffer_values));
-        new_z_values.storeu(z_buffer_row + x);
-        mask &= float2bits(z_mask);
-
-        u32 *pixel = pixel_row + x;
-        v4i original_color = v4i::loadu(pixel);
-        v4i masked_out = (mask & grey) | andnot(mask, original_color);
-        masked_out.storeu(pixel);
+  for (int by = bounds.block_min.y; by <= bounds.block_max.y; ++by) {
+    for (int bx = bounds.block_min.x; bx <= bounds.block_max.x; ++bx) {
+      int block = by * Raster_Tile::kBlocks + bx;
+      if (bounds.max_z < tile->block_min_depth[block]) continue;
+
+      // Bottom left pixel of the block in area coordinates
+      int bottom_row = by * block_size + block_size - 1;
+      r32 x0 = (r32)(tile->origin.x + bx * block_size);
+      r32 y0 = (r32)(tile->origin.y + tile->height - 1 - bottom_row);
+
+      Block_Coverage coverage = classify_block(&edges, x0, y0);
+      if (coverage == Block_Coverage_Outside) continue;
+      num_blocks++;
+      r32 lod = 0;
+      if (kTextured) {
+        r32 center = 0.5f * (block_size - 1);
+        lod = texturing.get_lod(x0 + center, y0 + center);
       }
 
-      // One step to the right
-      w0 += e12.step_x;
-      w1 += e20.step_x;
-      w2 += e01.step_x;
-      x_wide += x_step_wide;
+      // Barycentric coordinates at the start of the bottom row
+      v4 w_row[3];
+      for (int i = 0; i < 3; ++i) {
+        w_row[i] = v4(edges.a[i]) * (v4(x0) + lane_x) +
+                   v4(edges.b[i] * y0 + edges.c[i]);
+      }
+
+      u32 *pixel_row = tile->pixels + bottom_row * pitch + bx * block_size;
+      r32 *z_buffer_row = tile->depth + bottom_row * pitch + bx * block_size;
+
+      for (int y = 0; y < block_size; ++y) {
+        v4 w0 = w_row[0];
+        v4 w1 = w_row[1];
+        v4 w2 = w_row[2];
+
+        for (int x = 0; x < block_size; x += 4) {
+          // If point is on or inside all edges for any pixels, render
+          // those pixels
+          v4i mask = all_lanes;
+          if (coverage == Block_Coverage_Partial) {
+            mask = float2bits(
+                v4_and(cmpge(w0, zero), cmpge(w1, zero), cmpge(w2, zero)));
+          }
+
+          // Only the pixels which pass the depth test are shaded
+          v4 z_values = w0 * z0 + w1 * z1 + w2 * z2;
+          v4 z_buffer_values = v4::loadu(z_buffer_row + x);
+          v4 z_mask =
+              v4_and(bits2float(mask), cmpge(z_values, z_buffer_values));
+          if (movemask(z_mask)) {
+            v4_select(z_buffer_values, z_values, z_mask)
+                .storeu(z_buffer_row + x);
+            touched_blocks |= (u64)1 << block;
+            mask = float2bits(z_mask);
+
+            v4 intensity = w0 * in[0] + w1 * in[1] + w2 * in[2];
+            intensity = v4_and(intensity, cmpge(intensity, zero));
+            intensity = v4_lerp(intensity, min_intensity, max_intensity);
+            v4i color;
+            if (kTextured) {
+              color = texture_color(&texturing, w0, w1, w2, intensity, lod);
+            } else {
+              v4i grey_ch = ftoi(intensity);
+              color = (shiftl<24>(grey_ch) | shiftl<16>(grey_ch) |
+                       shiftl<8>(grey_ch) | grey_ch);
+            }
+
+            u32 *pixel = pixel_row + x;
+            v4i original_color = v4i::loadu(pixel);
+            v4i masked_out = (mask & color) | andnot(mask, original_color);
+            masked_out.storeu(pixel);
+          }
+
+          // One step to the right
+          w0 += step_x[0];
+          w1 += step_x[1];
+          w2 += step_x[2];
+        }
+
+        // One row step up
+        for (int i = 0; i < 3; ++i) {
+          w_row[i] += step_y[i];
+        }
+        pixel_row -= pitch;
+        z_buffer_row -= pitch;
+      }
     }
+  }
+  TIME_END(rasterization, num_blocks * block_size * block_size);
+
+  tile->dirty_blocks |= touched_blocks;
+}
+
+// Same as above, a block row at a time
+template <bool kTextured>
+ED_AVX2 void triangle_rasterize_avx2(Raster_Tile *tile,
+                                     Raster_Triangle *triangle) {
+  TIMED_BLOCK();
+
+  v3 *verts = triangle->verts;
+  Raster_Bounds bounds;
+  if (!get_raster_bounds(tile, verts, &bounds)) return;
+  Raster_Edges edges;
+  if (!edges.init(verts)) return;
+  Raster_Texturing texturing;
+  if (kTextured) texturing.init(triangle, &edges);
 
-    // One row step up
-    w0_row += e12.step_y;
-    w1_row += e20.step_y;
-    w2_row += e01.step_y;
-    pixel_row -= pitch;
-    z_buffer_row -= pitch;
+  v8 z0 = v8(verts[0].z);
+  v8 z1 = v8(verts[1].z);
+  v8 z2 = v8(verts[2].z);
+
+  v8 in[3];
+  for (int i = 0; i < 3; ++i) {
+    in[i] = v8(triangle->intensity[i]);
   }
-  TIME_END(rasterization, (p_max.x - p_min.x + 1) * (p_max.y - p_min.y + 1));
+
+  v8 zero = v8::zero();
+  v8 all_lanes = bits2float(v8i(-1));
+  v8 lane_x = v8(0, 1, 2, 3, 4, 5, 6, 7);
+
+  v8 max_intensity = kTextured ? v8(1.0f) : v8(220.0f);
+  v8 min_intensity = kTextured ? v8(0.2f) : v8(40.0f);
+
+  int pitch = Raster_Tile::kSize;
+  int block_size = Raster_Tile::kBlockSize;
+  u64 touched_blocks = 0;
+  int num_blocks = 0;
+
+  TIME_BEGIN(rasterization_avx2);
+  for (int by = bounds.block_min.y; by <= bounds.block_max.y; ++by) {
+    for (int bx = bounds.block_min.x; bx <= bounds.block_max.x; ++bx) {
+      int block = by * Raster_Tile::kBlocks + bx;
+      if (bounds.max_z < tile->block_min_depth[block]) continue;
+
+      int bottom_row = by * block_size + block_size - 1;
+      r32 x0 = (r32)(tile->origin.x + bx * block_size);
+      r32 y0 = (r32)(tile->origin.y + tile->height - 1 - bottom_row);
+
+      Block_Coverage coverage = classify_block(&edges, x0, y0);
+      if (coverage == Block_Coverage_Outside) continue;
+      num_blocks++;
+      r32 lod = 0;
+      if (kTextured) {
+        r32 center = 0.5f * (block_size - 1);
+        lod = texturing.get_lod(x0 + center, y0 + center);
+      }
+
+      v8 w[3];
+      for (int i = 0; i < 3; ++i) {
+        w[i] = v8(edges.a[i]) * (v8(x0) + lane_x) +
+               v8(edges.b[i] * y0 + edges.c[i]);
+      }
+
+      u32 *pixel_row = tile->pixels + bottom_row * pitch + bx * block_size;
+      r32 *z_buffer_row = tile->depth + bottom_row * pitch + bx * block_size;
+
+      for (int y = 0; y < block_size; ++y) {
+        v8 mask = all_lanes;
+        if (coverage == Block_Coverage_Partial) {
+          mask = v8_and(cmpge(w[0], zero), cmpge(w[1], zero),
+                        cmpge(w[2], zero));
+        }
+
+        v8 z_values = w[0] * z0 + w[1] * z1 + w[2] * z2;
+        v8 z_buffer_values = v8::loadu(z_buffer_row);
+        v8 z_mask = v8_and(mask, cmpge(z_values, z_buffer_values));
+        if (movemask(z_mask)) {
+          v8_select(z_buffer_values, z_values, z_mask).storeu(z_buffer_row);
+          touched_blocks |= (u64)1 << block;
+
+          v8 intensity = w[0] * in[0] + w[1] * in[1] + w[2] * in[2];
+          intensity = v8_and(intensity, cmpge(intensity, zero));
+          intensity = v8_lerp(intensity, min_intensity, max_intensity);
+          v8i color;
+          if (kTextured) {
+            color = texture_color(&texturing, w[0], w[1], w[2], intensity,
+                                  lod);
+          } else {
+            v8i grey_ch = ftoi(intensity);
+            color = (shiftl<24>(grey_ch) | shiftl<16>(grey_ch) |
+                     shiftl<8>(grey_ch) | grey_ch);
+          }
+
+          v8 original_color = bits2float(v8i::loadu(pixel_row));
+          v8 result = v8_select(original_color, bits2float(color), z_mask);
+          float2bits(result).storeu(pixel_row);
+        }
+
+        for (int i = 0; i < 3; ++i) {
+          w[i] += v8(edges.b[i]);
+        }
+        pixel_row -= pitch;
+        z_buffer_row -= pitch;
+      }
+    }
+  }
+  TIME_END(rasterization_avx2, num_blocks * block_size * block_size);
+
+  tile->dirty_blocks |= touched_blocks;
 }
 
 void triangle_shaded(Area *area, v3 verts[], v3 vns[], r32 *z_buffer,
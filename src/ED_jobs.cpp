@@ -0,0 +1,153 @@
+inline void spin_lock(i32 volatile *lock) {
+  while (atomic_compare_exchange(lock, 1, 0) != 0) {
+    _mm_pause();
+  }
+}
+
+inline void spin_unlock(i32 volatile *lock) {
+  atomic_compare_exchange(lock, 0, 1);
+}
+
+void Job_Deque::push(Job *job) {
+  spin_lock(&this->lock);
+  if (this->bottom - this->top == this->capacity) {
+    // Grow, keeping the jobs in place relative to top
+    int new_capacity = this->capacity ? 2 * this->capacity : 64;
+    Job *new_jobs = (Job *)malloc(new_capacity * sizeof(Job));
+    for (int i = this->top; i < this->bottom; ++i) {
+      new_jobs[i & (new_capacity - 1)] = this->jobs[i & (this->capacity - 1)];
+    }
+    free(this->jobs);
+    this->jobs = new_jobs;
+    this->capacity = new_capacity;
+  }
+  this->jobs[this->bottom & (this->capacity - 1)] = *job;
+  this->bottom++;
+  spin_unlock(&this->lock);
+}
+
+bool Job_Deque::pop(Job *job) {
+  if (this->bottom == this->top) return false;  // racy, but only a hint
+  bool result = false;
+  spin_lock(&this->lock);
+  if (this->bottom > this->top) {
+    this->bottom--;
+    *job = this->jobs[this->bottom & (this->capacity - 1)];
+    result = true;
+  }
+  spin_unlock(&this->lock);
+  return result;
+}
+
+bool Job_Deque::steal(Job *job) {
+  if (this->bottom == this->top) return false;
+  bool result = false;
+  spin_lock(&this->lock);
+  if (this->bottom > this->top) {
+    *job = this->jobs[this->top & (this->capacity - 1)];
+    this->top++;
+    result = true;
+  }
+  spin_unlock(&this->lock);
+  return result;
+}
+
+// Takes the newest job of the group, wherever it is in the deque
+bool Job_Deque::take(Job *job, Job_Group *group) {
+  if (this->bottom == this->top) return false;
+  bool result = false;
+  spin_lock(&this->lock);
+  int mask = this->capacity - 1;
+  for (int i = this->bottom - 1; i >= this->top; --i) {
+    if (this->jobs[i & mask].group != group) continue;
+    *job = this->jobs[i & mask];
+    for (int j = i + 1; j < this->bottom; ++j) {
+      this->jobs[(j - 1) & mask] = this->jobs[j & mask];
+    }
+    this->bottom--;
+    result = true;
+    break;
+  }
+  spin_unlock(&this->lock);
+  return result;
+}
+
+void Job_System::init(int num_workers) {
+  this->num_threads = num_workers + 1;
+  this->deques =
+      (Job_Deque *)malloc(this->num_threads * sizeof(*this->deques));
+  memset(this->deques, 0, this->num_threads * sizeof(*this->deques));
+}
+
+// Copies `data_size` bytes of data into the job and adds it to the
+// deque of the calling thread
+void Job_System::add(Job_Function *function, void *data, int data_size,
+                     Job_Group *group, int thread_index) {
+  assert(data_size <= Job::kMaxDataSize);
+  Job job;
+  job.function = function;
+  job.group = group;
+  memcpy(job.data, data, data_size);
+  if (group) atomic_add(&group->num_pending, 1);
+  this->deques[thread_index].push(&job);
+  this->wake_up_workers(1);
+}
+
+void Job_System::run_job(Job *job, int thread_index) {
+  if (!job->group || !job->group->cancelled) {
+    job->function(job->data, thread_index);
+  }
+  if (job->group) atomic_add(&job->group->num_pending, -1);
+}
+
+// Runs one job from the thread's own deque or steals one from
+// the others. Returns false if there was nothing to do
+bool Job_System::run_next_job(int thread_index) {
+  Job job;
+  bool found = this->deques[thread_index].pop(&job);
+  for (int i = 1; !found && i < this->num_threads; ++i) {
+    int victim = (thread_index + i) % this->num_threads;
+    found = this->deques[victim].steal(&job);
+  }
+  if (!found) return false;
+
+  this->run_job(&job, thread_index);
+  return true;
+}
+
+// Like run_next_job, but only runs the jobs of the group
+bool Job_System::run_group_job(Job_Group *group, int thread_index) {
+  Job job;
+  bool found = false;
+  for (int i = 0; !found && i < this->num_threads; ++i) {
+    int victim = (thread_index + i) % this->num_threads;
+    found = this->deques[victim].take(&job, group);
+  }
+  if (!found) return false;
+
+  this->run_job(&job, thread_index);
+  return true;
+}
+
+// Helps with the jobs of the group instead of blocking until it's
+// done. Other jobs are left to the workers, so that waiting for short
+// jobs doesn't take as long as some unrelated long one
+void Job_System::wait(Job_Group *group, int thread_index) {
+  while (!group->is_done()) {
+    if (!this->run_group_job(group, thread_index)) _mm_pause();
+  }
+}
+
+// Drops the queued jobs of the group and waits for the running ones.
+// Long jobs should check for their own cancellation to return early
+void Job_System::cancel(Job_Group *group, int thread_index) {
+  group->cancelled = true;
+  this->wait(group, thread_index);
+  group->cancelled = false;
+}
+
+void Job_System::worker_loop(int thread_index) {
+  for (;;) {
+    if (!this->run_next_job(thread_index)) this->wait_for_jobs();
+  }
+}
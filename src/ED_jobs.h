@@ -0,0 +1,59 @@
+#ifndef ED_JOBS_H
+#define ED_JOBS_H
+
+// Jobs get a copy of their data and the index of the thread running
+// them (0 is the main thread, workers start from 1)
+typedef void Job_Function(void *data, int thread_index);
+
+// Counts the jobs which haven't finished yet
+struct Job_Group {
+  i32 volatile num_pending = 0;
+  bool volatile cancelled = false;  // queued jobs are dropped
+
+  bool is_done() { return this->num_pending == 0; }
+};
+
+struct Job {
+  static const int kMaxDataSize = 64;
+
+  Job_Function *function;
+  Job_Group *group;
+  u8 data[kMaxDataSize];
+};
+
+// Every thread owns a deque. The owner adds and takes jobs at the
+// bottom, others steal the oldest jobs from the top. Jobs are coarse
+// and the locked sections are tiny, so a spin lock is enough
+struct Job_Deque {
+  Job *jobs;     // ring buffer, capacity is a power of 2
+  int capacity;
+  int volatile top;
+  int volatile bottom;
+  i32 volatile lock;
+  u8 padding[64];  // keep locks of different threads on separate lines
+
+  void push(Job *);
+  bool pop(Job *);
+  bool steal(Job *);
+  bool take(Job *, Job_Group *);
+};
+
+struct Job_System {
+  Job_Deque *deques;
+  int num_threads;  // including the main thread
+
+  void init(int);
+  void add(Job_Function *, void *, int, Job_Group *, int thread_index = 0);
+  void run_job(Job *, int);
+  bool run_next_job(int);
+  bool run_group_job(Job_Group *, int);
+  void wait(Job_Group *, int thread_index = 0);
+  void cancel(Job_Group *, int thread_index = 0);
+  void worker_loop(int);
+
+  // Platform-specific
+  virtual void wake_up_workers(int) = 0;
+  virtual void wait_for_jobs() = 0;
+};
+
+#endif  // ED_JOBS_H
@@ -2,20 +2,33 @@
 
 #include <x86intrin.h>  // __rdtsc()
 #include <pthread.h>
+#include <sched.h>
 #include <semaphore.h>
 
 #include "ED_base.h"
 #include "debug/ED_debug.h"
 #include "ED_math.h"
 #include "ED_core.h"
+#include "ED_texture.h"
 #include "ED_model.h"
+#include "ED_bvh.h"
+#include "ED_mesh_cache.h"
+#include "ED_jobs.h"
+#include "ED_stream.h"
+#include "ED_raster.h"
 #include "editors/editors.h"
 #include "ui/ED_ui.h"
 
 #include "ED_core.cpp"
 #include "ED_math.cpp"
+#include "ED_texture.cpp"
 #include "ED_model.cpp"
+#include "ED_bvh.cpp"
+#include "ED_mesh_cache.cpp"
+#include "ED_jobs.cpp"
+#include "ED_stream.cpp"
 #include "ED_drawing.cpp"
+#include "ED_raster.cpp"
 #include "editors/3dview.cpp"
 #include "editors/raytrace.cpp"
 #include "ui/ED_ui.cpp"
@@ -24,6 +37,9 @@
 
 #include <unistd.h>
 #include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
@@ -43,24 +59,56 @@ global GLuint g_texture_handle;
 
 // =========================== Platform code ==================================
 
-struct Linux_Raytrace_Work_Queue : Raytrace_Work_Queue {
+struct Linux_Job_System : Job_System {
   sem_t semaphore;
 
-  virtual void add_entry(Raytrace_Work_Entry);
+  virtual void wake_up_workers(int);
+  virtual void wait_for_jobs();
 };
 
-void Linux_Raytrace_Work_Queue::add_entry(Raytrace_Work_Entry entry) {
-  u32 new_next_entry_to_add =
-      (this->next_entry_to_add + 1) % COUNT_OF(this->entries);
-  assert(new_next_entry_to_add != this->next_entry_to_do);
-  Raytrace_Work_Entry *entry_to_add = this->entries + this->next_entry_to_add;
-  *entry_to_add = entry;
-  asm volatile("" ::: "memory");
-  this->next_entry_to_add = new_next_entry_to_add;
-  sem_post(&this->semaphore);
+void Linux_Job_System::wake_up_workers(int count) {
+  for (int i = 0; i < count; ++i) {
+    sem_post(&this->semaphore);
+  }
 }
 
-global Linux_Raytrace_Work_Queue g_raytrace_queue;
+void Linux_Job_System::wait_for_jobs() { sem_wait(&this->semaphore); }
+
+bool Mapped_File::map(char *filename) {
+  this->data = NULL;
+  this->size = 0;
+  this->modified_time = 0;
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) return false;
+
+  bool result = false;
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) == 0) {
+    this->size = (size_t)file_stat.st_size;
+    this->modified_time = (u64)file_stat.st_mtim.tv_sec * 1000000000 +
+                          (u64)file_stat.st_mtim.tv_nsec;
+    if (this->size == 0) {
+      result = true;  // empty files can't be mapped
+    } else {
+      void *memory = mmap(NULL, this->size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (memory != MAP_FAILED) {
+        madvise(memory, this->size, MADV_SEQUENTIAL);
+        this->data = (char *)memory;
+        result = true;
+      }
+    }
+  }
+  close(fd);  // the mapping stays valid
+  return result;
+}
+
+void Mapped_File::unmap() {
+  if (this->data != NULL) munmap(this->data, this->size);
+  this->data = NULL;
+  this->size = 0;
+}
+
+global Linux_Job_System g_job_system;
 global timespec g_timestamp;
 global XImage *g_ximage;
 
@@ -81,36 +129,19 @@ u64 linux_time_elapsed() {
   return result;
 }
 
-void *raytrace_worker_thread(void *arg) {
-  thread_info *info = (thread_info *)arg;
-
-  Linux_Raytrace_Work_Queue *queue = &g_raytrace_queue;
-  for (;;) {
-    u32 original_next_entry_to_do = queue->next_entry_to_do;
-    u32 new_next_entry_to_do =
-        (original_next_entry_to_do + 1) % COUNT_OF(queue->entries);
-
-    if (original_next_entry_to_do != queue->next_entry_to_add) {
-      // There's probably work to do
-      u32 index = __sync_val_compare_and_swap(&queue->next_entry_to_do,
-                                              original_next_entry_to_do,
-                                              new_next_entry_to_do);
-      if (index == original_next_entry_to_do) {
-        // No other thread has beaten us to it, do the work
-        Raytrace_Work_Entry entry = queue->entries[index];
-        queue->entries_in_progress[info->thread_num] = index;
-        // The line above may cause a machine clear but that's probably OK?
-        entry.editor->trace_tile(entry.models, entry.start, entry.end);
-        printf("Thread %d did work entry %d\n", info->thread_num, index);
-        queue->entries_in_progress[info->thread_num] = -1;
-      }
-    } else {
-      // Sleep
-      printf("Thread %d went to sleep\n", info->thread_num);
-      sem_wait(&queue->semaphore);
-      printf("Thread %d has woken up\n", info->thread_num);
-    }
+int linux_get_num_cores() {
+  // Respect the affinity mask (e.g. taskset or a container) if possible
+  cpu_set_t cpus;
+  if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0) {
+    return CPU_COUNT(&cpus);
   }
+  return (int)sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+void *worker_thread(void *arg) {
+  thread_info *info = (thread_info *)arg;
+  g_job_system.worker_loop(info->thread_num);
+  return NULL;
 }
 
 int main(int argc, char *argv[]) {
@@ -118,11 +149,34 @@ int main(int argc, char *argv[]) {
   g_program_memory.start = malloc(MAX_INTERNAL_MEMORY_SIZE);
   g_program_memory.free_memory = g_program_memory.start;
 
+  // Create worker threads before loading, which uses them
+  {
+    g_num_worker_threads =
+        choose_num_worker_threads(argc, argv, linux_get_num_cores());
+    g_threads =
+        (thread_info *)malloc(g_num_worker_threads * sizeof(*g_threads));
+
+    // Init job system, the main thread gets index 0
+    g_job_system.init(g_num_worker_threads);
+    sem_init(&g_job_system.semaphore, 0, 0);
+
+    for (int i = 0; i < g_num_worker_threads; ++i) {
+      g_threads[i].thread_num = i + 1;
+      pthread_t thread_id;  // we forget it since we don't want to talk about it
+                            // (maybe tmp)
+      int error =
+          pthread_create(&thread_id, NULL, worker_thread, &g_threads[i]);
+      if (error) {
+        printf("Can't create thread\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+
   // Main program state - note that window size is set there
   Program_State *state =
       (Program_State *)g_program_memory.allocate(sizeof(Program_State));
-  state->init(&g_program_memory, &g_pixel_buffer,
-              (Raytrace_Work_Queue *)&g_raytrace_queue);
+  state->init(&g_program_memory, &g_pixel_buffer, &g_job_system);
 
 #if USE_GLFW
 
@@ -212,26 +266,6 @@ int main(int argc, char *argv[]) {
   User_Input *new_input = &inputs[1];
   *new_input = {};
 
-  // Create worked threads
-  {
-    // Init work queue
-    g_raytrace_queue.next_entry_to_add = 0;
-    g_raytrace_queue.next_entry_to_do = 0;
-    sem_init(&g_raytrace_queue.semaphore, 0, 0);
-
-    for (int i = 0; i < g_kNumThreads; ++i) {
-      g_threads[i].thread_num = i;
-      pthread_t thread_id;  // we forget it since we don't want to talk about it
-                            // (maybe tmp)
-      int error = pthread_create(&thread_id, NULL, raytrace_worker_thread,
-                                 &g_threads[i]);
-      if (error) {
-        printf("Can't create thread\n");
-        exit(EXIT_FAILURE);
-      }
-    }
-  }
-
   // Main loop
   g_running = true;
 
@@ -441,20 +475,30 @@ int main(int argc, char *argv[]) {
 #if ED_LEAKCHECK
   // Only freeing everything for a leak check
   printf("======================= freeing ==========================\n");
+  // Free areas first, which stops their ray trace tiles, so nothing
+  // reads the models while they are freed
+  for (int i = 0; i < state->UI->num_areas; ++i) {
+    state->UI->areas[i]->editor_raytrace.destroy(state->jobs);
+    free(state->UI->areas[i]);
+  }
+  sb_free(state->UI->areas);
+
   // Free models
   for (int i = 0; i < sb_count(state->models); ++i) {
     state->models[i].destroy();
   }
   sb_free(state->models);
-
-  // Free areas
-  for (int i = 0; i < state->UI->num_areas; ++i) {
-    if (state->UI->areas[i]->editor_raytrace.backbuffer.memory) {
-      free(state->UI->areas[i]->editor_raytrace.backbuffer.memory);
-    }
-    free(state->UI->areas[i]);
+  for (int i = 0; i < sb_count(state->mesh_caches); ++i) {
+    state->mesh_caches[i].unmap();
   }
-  sb_free(state->UI->areas);
+  sb_free(state->mesh_caches);
+  for (int i = 0; i < sb_count(state->mesh_streams); ++i) {
+    state->mesh_streams[i]->destroy(state->jobs);
+    free(state->mesh_streams[i]);
+  }
+  sb_free(state->mesh_streams);
+  state->textures->destroy();
+  free(state->textures);
 
   // Free splitters
   for (int i = 0; i < state->UI->num_splitters; ++i) {
@@ -464,6 +508,8 @@ int main(int argc, char *argv[]) {
 
   // Free general stuff
   free(state->UI->z_buffer);
+  state->rasterizer->destroy();
+  free(state->rasterizer);
   free(state->UI);
   free(g_font.tmp_bitmap);
   free(g_font.ttf_raw_data);
@@ -166,12 +166,14 @@ m4x4 Matrix::persp_projection(r32 l, r32 r, r32 b, r32 t, r32 n, r32 f) {
   // the values in the third row should have opposite sign
   assert(n < 0);
 
+  // Negated so that w = -z is positive in front of the camera,
+  // which doesn't change the point after the division
   // clang-format off
   m4x4 result = {
-    2.0f*n/(r-l), 0,            -(r+l)/(r-l),  0,
-    0,            2.0f*n/(t-b), -(t+b)/(t-b),  0,
-    0,            0,            -(f+n)/(f-n),  2.0f*f*n/(f-n),
-    0,            0,             1,            0,
+    -2.0f*n/(r-l), 0,             (r+l)/(r-l),  0,
+     0,           -2.0f*n/(t-b),  (t+b)/(t-b),  0,
+     0,            0,             (f+n)/(f-n), -2.0f*f*n/(f-n),
+     0,            0,            -1,            0,
   };
   // clang-format on
 
@@ -303,3 +305,125 @@ m4x4 Matrix::viewport(int x, int y, int width, int height, int z_depth) {
   // clang-format on
   return result;
 }
+
+// One row of the matrix times 4 vectors. The sums are done in the same
+// order as in M * v so that the results match exactly
+inline __m128 transform_row(__m128 *row, __m128 x, __m128 y, __m128 z,
+                            bool is_point) {
+  __m128 sum = _mm_add_ps(_mm_mul_ps(row[0], x), _mm_mul_ps(row[1], y));
+  sum = _mm_add_ps(sum, _mm_mul_ps(row[2], z));
+  if (is_point) sum = _mm_add_ps(sum, row[3]);
+  return sum;
+}
+
+inline __m128i clip_bit(__m128 outside, int flag) {
+  return _mm_and_si128(_mm_castps_si128(outside), _mm_set1_epi32(flag));
+}
+
+// Transforms 4 points or vectors per iteration in SoA form. The output
+// is v3, or v4 if the points are not homogenized
+void transform_batch(const m4x4 &M, v3 *in, int count, r32 *out,
+                     u8 *clip_flags, bool is_point, bool homogenize) {
+  int out_size = (is_point && !homogenize) ? 4 : 3;
+  __m128 m[16];
+  for (int i = 0; i < 16; ++i) {
+    m[i] = _mm_set1_ps(M.E[i]);
+  }
+
+  v3 in_rest[4] = {};
+  r32 out_rest[16];
+  u8 flags_rest[4];
+  for (int first = 0; first < count; first += 4) {
+    r32 *src = in[first].E;
+    r32 *dst = out + first * out_size;
+    u8 *flags = clip_flags ? clip_flags + first : NULL;
+
+    // Pad the rest to 4
+    int rest = count - first;
+    if (rest < 4) {
+      memcpy(in_rest, in + first, rest * sizeof(v3));
+      src = in_rest[0].E;
+      dst = out_rest;
+      flags = flags ? flags_rest : NULL;
+    }
+
+    // Load without reading past the 4th vector and transpose
+    __m128 x = _mm_loadu_ps(src);
+    __m128 y = _mm_loadu_ps(src + 3);
+    __m128 z = _mm_loadu_ps(src + 6);
+    __m128 w = _mm_loadu_ps(src + 8);
+    w = _mm_shuffle_ps(w, w, _MM_SHUFFLE(3, 3, 2, 1));
+    _MM_TRANSPOSE4_PS(x, y, z, w);
+
+    __m128 rx = transform_row(m, x, y, z, is_point);
+    __m128 ry = transform_row(m + 4, x, y, z, is_point);
+    __m128 rz = transform_row(m + 8, x, y, z, is_point);
+    __m128 rw = transform_row(m + 12, x, y, z, is_point);
+
+    if (is_point && flags != NULL) {
+      __m128 neg_w = _mm_sub_ps(_mm_setzero_ps(), rw);
+      __m128i bits = _mm_or_si128(
+          clip_bit(_mm_cmplt_ps(rx, neg_w), Clip_Left),
+          clip_bit(_mm_cmpgt_ps(rx, rw), Clip_Right));
+      bits = _mm_or_si128(bits, _mm_or_si128(
+          clip_bit(_mm_cmplt_ps(ry, neg_w), Clip_Bottom),
+          clip_bit(_mm_cmpgt_ps(ry, rw), Clip_Top)));
+      bits = _mm_or_si128(bits, _mm_or_si128(
+          clip_bit(_mm_cmplt_ps(rz, neg_w), Clip_Far),
+          clip_bit(_mm_cmpgt_ps(rz, rw), Clip_Near)));
+      bits = _mm_packs_epi32(bits, bits);
+      bits = _mm_packus_epi16(bits, bits);
+      i32 packed = _mm_cvtsi128_si32(bits);
+      memcpy(flags, &packed, 4);
+    }
+
+    if (is_point && homogenize) {
+      // Leave the points at infinity as they are
+      __m128 is_zero = _mm_cmpeq_ps(rw, _mm_setzero_ps());
+      rw = _mm_or_ps(_mm_andnot_ps(is_zero, rw),
+                     _mm_and_ps(is_zero, _mm_set1_ps(1.0f)));
+      rx = _mm_div_ps(rx, rw);
+      ry = _mm_div_ps(ry, rw);
+      rz = _mm_div_ps(rz, rw);
+    }
+
+    _MM_TRANSPOSE4_PS(rx, ry, rz, rw);
+    if (out_size == 4) {
+      _mm_storeu_ps(dst, rx);
+      _mm_storeu_ps(dst + 4, ry);
+      _mm_storeu_ps(dst + 8, rz);
+      _mm_storeu_ps(dst + 12, rw);
+    } else {
+      _mm_storeu_ps(dst, rx);
+      _mm_storeu_ps(dst + 3, ry);
+      _mm_storeu_ps(dst + 6, rz);
+      _mm_storel_pi((__m64 *)(dst + 9), rw);
+      _mm_store_ss(dst + 11, _mm_movehl_ps(rw, rw));
+    }
+
+    if (rest < 4) {
+      memcpy(out + first * out_size, out_rest, rest * out_size * sizeof(r32));
+      if (flags) memcpy(clip_flags + first, flags_rest, rest);
+    }
+  }
+}
+
+// Input and output may be the same array
+void Matrix::transform_points(const m4x4 &M, v3 *points, int count,
+                              v3 *result, u8 *clip_flags) {
+  TIMED_BLOCK();
+  transform_batch(M, points, count, result[0].E, clip_flags, true, true);
+}
+
+// Keeps w, for clipping
+void Matrix::transform_points(const m4x4 &M, v3 *points, int count,
+                              v4 *result, u8 *clip_flags) {
+  TIMED_BLOCK();
+  transform_batch(M, points, count, result[0].E, clip_flags, true, false);
+}
+
+void Matrix::transform_vectors(const m4x4 &M, v3 *vectors, int count,
+                               v3 *result) {
+  TIMED_BLOCK();
+  transform_batch(M, vectors, count, result[0].E, NULL, false, true);
+}
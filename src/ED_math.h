@@ -26,6 +26,12 @@ inline r32 floor_r32(r32 value) {
   return (r32)((int)value);
 }
 
+inline r32 ceil_r32(r32 value) {
+  r32 result = (r32)((int)value);
+  if (result < value) result += 1.0f;
+  return result;
+}
+
 int min3(int a, int b, int c) {
   if (a <= b && a <= c) return a;
   if (b <= a && b <= c) return b;
@@ -150,6 +156,9 @@ inline v4i cmplt(const v4i &a, const v4i &b) { return v4i(_mm_cmplt_epi32(a.simd
 inline v4i cmpgt(const v4i &a, const v4i &b) { return v4i(_mm_cmpgt_epi32(a.simd, b.simd)); }
 
 inline bool mask_not_zero(const v4i &a) { return _mm_movemask_epi8(a.simd) != 0; }
+
+// Multiplies the 16-bit halves of the lanes and keeps the low 16 bits of each product
+inline v4i mullo16(const v4i &a, const v4i &b) { return v4i(_mm_mullo_epi16(a.simd, b.simd)); }
 // inline bool is_all_zeros(const v4i &a) { return _mm_testz_si128(a.simd, a.simd) != 0; }
 // inline bool is_all_negative(const v4i &a) {
 //   return _mm_testc_si128(_mm_set1_epi32(0x80000000), a.simd) != 0;
@@ -158,6 +167,12 @@ inline bool mask_not_zero(const v4i &a) { return _mm_movemask_epi8(a.simd) != 0;
 // can't overload << since parameter to immed. shifts must be a compile-time constant
 // and debug builds that don't inline can't deal with this
 template<int N> inline v4i shiftl(const v4i &x) { return v4i(_mm_slli_epi32(x.simd, N)); }
+template<int N> inline v4i shiftr(const v4i &x) { return v4i(_mm_srli_epi32(x.simd, N)); }
+
+// No gather instruction before AVX2
+inline v4i gather(const u32 *base, const v4i &index) {
+  return v4i(base[index.x], base[index.y], base[index.z], base[index.w]);
+}
 
 
 union v4 {
@@ -213,6 +228,8 @@ inline v4 cmple(const v4 &a, const v4 &b) { return v4(_mm_cmple_ps(a.simd, b.sim
 inline v4 cmpgt(const v4 &a, const v4 &b) { return v4(_mm_cmpgt_ps(a.simd, b.simd)); }
 inline v4 cmpge(const v4 &a, const v4 &b) { return v4(_mm_cmpge_ps(a.simd, b.simd)); }
 
+inline int movemask(const v4 &a) { return _mm_movemask_ps(a.simd); }
+
 inline v4i ftoi(const v4 &v) { return v4i(_mm_cvttps_epi32(v.simd)); }
 inline v4i ftoi_round(const v4 &v) { return v4i(_mm_cvtps_epi32(v.simd)); }
 inline v4 itof(const v4i &v) { return v4(_mm_cvtepi32_ps(v.simd)); }
@@ -233,6 +250,117 @@ inline v4 v4_lerp(const v4 &t, const v4 &a, const v4 &b) {
 //   return v4(_mm_blendv_ps(a.simd, b.simd, _mm_castsi128_ps(mask.simd)));
 // }
 
+// Select b where mask is set and a elsewhere. Needs a full lane mask
+// such as the ones returned by the comparisons, but only SSE2
+inline v4 v4_select(const v4 &a, const v4 &b, const v4 &mask) {
+  return v4_or(v4_and(mask, b), v4_andnot(mask, a));
+}
+
+// 8-wide versions of the above. Only usable in ED_AVX2 functions
+union v8i {
+  i32 E[8];
+  __m256i simd;
+
+  ED_AVX2 v8i() {}
+  ED_AVX2 explicit v8i(i32 x) : simd(_mm256_set1_epi32(x)) {}
+  ED_AVX2 explicit v8i(const __m256i &in) : simd(in) {}
+  ED_AVX2 v8i(const v8i &v) : simd(v.simd) {}
+  ED_AVX2 v8i(i32 a, i32 b, i32 c, i32 d, i32 e, i32 f, i32 g, i32 h)
+      : simd(_mm256_setr_epi32(a, b, c, d, e, f, g, h)) {}
+
+  ED_AVX2 static v8i zero() { return v8i(_mm256_setzero_si256()); }
+  ED_AVX2 static v8i loadu(const u32 *ptr) { return v8i(_mm256_loadu_si256((__m256i *)ptr)); }
+  ED_AVX2 void storeu(u32 *ptr) { _mm256_storeu_si256((__m256i *)ptr, simd); }
+
+  ED_AVX2 v8i &operator =(const v8i &v) { simd = v.simd; return *this; }
+  ED_AVX2 v8i &operator+=(const v8i &v) { simd = _mm256_add_epi32(simd, v.simd); return *this; }
+  ED_AVX2 v8i &operator-=(const v8i &v) { simd = _mm256_sub_epi32(simd, v.simd); return *this; }
+  ED_AVX2 v8i &operator|=(const v8i &v) { simd = _mm256_or_si256(simd, v.simd); return *this; }
+  ED_AVX2 v8i &operator&=(const v8i &v) { simd = _mm256_and_si256(simd, v.simd); return *this; }
+};
+
+ED_AVX2 inline v8i operator+(const v8i &a, const v8i &b) { return v8i(_mm256_add_epi32(a.simd, b.simd)); }
+ED_AVX2 inline v8i operator-(const v8i &a, const v8i &b) { return v8i(_mm256_sub_epi32(a.simd, b.simd)); }
+ED_AVX2 inline v8i operator*(const v8i &a, const v8i &b) { return v8i(_mm256_mullo_epi32(a.simd, b.simd)); }
+ED_AVX2 inline v8i operator|(const v8i &a, const v8i &b) { return v8i(_mm256_or_si256(a.simd, b.simd)); }
+ED_AVX2 inline v8i operator&(const v8i &a, const v8i &b) { return v8i(_mm256_and_si256(a.simd, b.simd)); }
+
+ED_AVX2 inline v8i andnot(const v8i &a, const v8i &b) { return v8i(_mm256_andnot_si256(a.simd, b.simd)); }
+ED_AVX2 inline v8i vmin(const v8i &a, const v8i &b) { return v8i(_mm256_min_epi32(a.simd, b.simd)); }
+ED_AVX2 inline v8i vmax(const v8i &a, const v8i &b) { return v8i(_mm256_max_epi32(a.simd, b.simd)); }
+
+ED_AVX2 inline v8i cmpgt(const v8i &a, const v8i &b) { return v8i(_mm256_cmpgt_epi32(a.simd, b.simd)); }
+ED_AVX2 inline v8i cmplt(const v8i &a, const v8i &b) { return v8i(_mm256_cmpgt_epi32(b.simd, a.simd)); }
+
+ED_AVX2 inline bool mask_not_zero(const v8i &a) { return _mm256_movemask_epi8(a.simd) != 0; }
+
+ED_AVX2 inline v8i mullo16(const v8i &a, const v8i &b) { return v8i(_mm256_mullo_epi16(a.simd, b.simd)); }
+
+template<int N> ED_AVX2 inline v8i shiftl(const v8i &x) { return v8i(_mm256_slli_epi32(x.simd, N)); }
+template<int N> ED_AVX2 inline v8i shiftr(const v8i &x) { return v8i(_mm256_srli_epi32(x.simd, N)); }
+
+ED_AVX2 inline v8i gather(const u32 *base, const v8i &index) {
+  return v8i(_mm256_i32gather_epi32((const int *)base, index.simd, 4));
+}
+
+union v8 {
+  r32 E[8];
+  __m256 simd;
+
+  ED_AVX2 v8() {}
+  ED_AVX2 explicit v8(r32 x) : simd(_mm256_set1_ps(x)) {}
+  ED_AVX2 explicit v8(const __m256 &in) : simd(in) {}
+  ED_AVX2 v8(const v8 &v) : simd(v.simd) {}
+  ED_AVX2 v8(r32 a, r32 b, r32 c, r32 d, r32 e, r32 f, r32 g, r32 h)
+      : simd(_mm256_setr_ps(a, b, c, d, e, f, g, h)) {}
+
+  ED_AVX2 static v8 zero() { return v8(_mm256_setzero_ps()); }
+  ED_AVX2 static v8 loadu(const r32 *ptr) { return v8(_mm256_loadu_ps(ptr)); }
+  ED_AVX2 void storeu(r32 *ptr) { _mm256_storeu_ps(ptr, simd); }
+
+  ED_AVX2 v8 &operator =(const v8 &v) { simd = v.simd; return *this; }
+  ED_AVX2 v8 &operator+=(const v8 &v) { simd = _mm256_add_ps(simd, v.simd); return *this; }
+  ED_AVX2 v8 &operator-=(const v8 &v) { simd = _mm256_sub_ps(simd, v.simd); return *this; }
+  ED_AVX2 v8 &operator*=(const v8 &v) { simd = _mm256_mul_ps(simd, v.simd); return *this; }
+  ED_AVX2 v8 &operator/=(const v8 &v) { simd = _mm256_div_ps(simd, v.simd); return *this; }
+};
+
+ED_AVX2 inline v8 operator+(const v8 &a, const v8 &b) { return v8(_mm256_add_ps(a.simd, b.simd)); }
+ED_AVX2 inline v8 operator-(const v8 &a, const v8 &b) { return v8(_mm256_sub_ps(a.simd, b.simd)); }
+ED_AVX2 inline v8 operator*(const v8 &a, const v8 &b) { return v8(_mm256_mul_ps(a.simd, b.simd)); }
+ED_AVX2 inline v8 operator/(const v8 &a, const v8 &b) { return v8(_mm256_div_ps(a.simd, b.simd)); }
+
+ED_AVX2 inline v8 v8_or(const v8 &a, const v8 &b) { return v8(_mm256_or_ps(a.simd, b.simd)); }
+ED_AVX2 inline v8 v8_and(const v8 &a, const v8 &b) { return v8(_mm256_and_ps(a.simd, b.simd)); }
+ED_AVX2 inline v8 v8_and(const v8 &a, const v8 &b, const v8 &c) {
+  return v8(_mm256_and_ps(a.simd, _mm256_and_ps(b.simd, c.simd)));
+}
+ED_AVX2 inline v8 v8_andnot(const v8 &a, const v8 &b) { return v8(_mm256_andnot_ps(a.simd, b.simd)); }
+
+ED_AVX2 inline v8 vmin(const v8 &a, const v8 &b) { return v8(_mm256_min_ps(a.simd, b.simd)); }
+ED_AVX2 inline v8 vmax(const v8 &a, const v8 &b) { return v8(_mm256_max_ps(a.simd, b.simd)); }
+
+ED_AVX2 inline v8 cmplt(const v8 &a, const v8 &b) { return v8(_mm256_cmp_ps(a.simd, b.simd, _CMP_LT_OS)); }
+ED_AVX2 inline v8 cmple(const v8 &a, const v8 &b) { return v8(_mm256_cmp_ps(a.simd, b.simd, _CMP_LE_OS)); }
+ED_AVX2 inline v8 cmpgt(const v8 &a, const v8 &b) { return v8(_mm256_cmp_ps(a.simd, b.simd, _CMP_GT_OS)); }
+ED_AVX2 inline v8 cmpge(const v8 &a, const v8 &b) { return v8(_mm256_cmp_ps(a.simd, b.simd, _CMP_GE_OS)); }
+
+ED_AVX2 inline int movemask(const v8 &a) { return _mm256_movemask_ps(a.simd); }
+
+ED_AVX2 inline v8i ftoi(const v8 &v) { return v8i(_mm256_cvttps_epi32(v.simd)); }
+ED_AVX2 inline v8 itof(const v8i &v) { return v8(_mm256_cvtepi32_ps(v.simd)); }
+
+ED_AVX2 inline v8i float2bits(const v8 &v) { return v8i(_mm256_castps_si256(v.simd)); }
+ED_AVX2 inline v8 bits2float(const v8i &v) { return v8(_mm256_castsi256_ps(v.simd)); }
+
+ED_AVX2 inline v8 v8_lerp(const v8 &t, const v8 &a, const v8 &b) {
+  return b * t + a * (v8(1.0f) - t);
+}
+
+ED_AVX2 inline v8 v8_select(const v8 &a, const v8 &b, const v8 &mask) {
+  return v8(_mm256_blendv_ps(a.simd, b.simd, mask.simd));
+}
+
 // clang-format on
 
 union basis3 {
@@ -325,6 +453,17 @@ union m4x4 {
 
 // clang-format on
 
+// Sides of the canonical view volume -w <= x, y, z <= w that a point is
+// outside of. Projection matrices keep w positive in front of the camera
+enum Clip_Flag {
+  Clip_Left = 1 << 0,
+  Clip_Right = 1 << 1,
+  Clip_Bottom = 1 << 2,
+  Clip_Top = 1 << 3,
+  Clip_Far = 1 << 4,
+  Clip_Near = 1 << 5,
+};
+
 namespace Matrix {
 m4x4 identity();
 // Rotation
@@ -345,6 +484,10 @@ m4x4 persp_projection(r32, r32, r32, r32, r32, r32);
 // Change frame
 m4x4 frame_to_canonical(basis3, v3);
 m4x4 canonical_to_frame(basis3, v3);
+// Batch transforms, 4 at a time. Same results as M * v3 and M * V4_v(v)
+void transform_points(const m4x4 &, v3 *, int, v3 *, u8 *clip_flags = NULL);
+void transform_points(const m4x4 &, v3 *, int, v4 *, u8 *clip_flags = NULL);
+void transform_vectors(const m4x4 &, v3 *, int, v3 *);
 }
 
 // ==================== Construction ======================
@@ -0,0 +1,244 @@
+// Only read when the modification time of the source doesn't match, so
+// it just has to be fast and good enough to notice edits
+u64 hash_file_contents(char *data, size_t size) {
+  u64 hash = 0x9E3779B97F4A7C15ull ^ size;
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    u64 word;
+    memcpy(&word, data + i, 8);
+    hash = (hash ^ word) * 0xFF51AFD7ED558CCDull;
+    hash ^= hash >> 32;
+  }
+  for (; i < size; ++i) {
+    hash = (hash ^ (u8)data[i]) * 0x100000001B3ull;
+  }
+  return hash;
+}
+
+// Arrays start at a cache line and are preceded by a line which ends
+// with the header of a stretchy buffer
+const u64 kMeshCacheAlignment = 64;
+
+bool Mesh_Cache_Writer::begin(char *path) {
+  this->file = fopen(path, "wb");
+  if (this->file == NULL) return false;
+  this->filename = path;
+  this->size = 0;
+  this->models = NULL;
+  this->failed = false;
+
+  // Left empty until the end, so an unfinished cache is never valid
+  Mesh_Cache_Header header = {};
+  this->write(&header, sizeof(header));
+  return true;
+}
+
+void Mesh_Cache_Writer::write(void *data, u64 count) {
+  if (count > 0 && fwrite(data, 1, count, this->file) != count) {
+    this->failed = true;
+  }
+  this->size += count;
+}
+
+void Mesh_Cache_Writer::pad(u64 alignment) {
+  u8 zeros[kMeshCacheAlignment] = {};
+  u64 padding = (alignment - this->size % alignment) % alignment;
+  this->write(zeros, padding);
+}
+
+template <typename T>
+u64 Mesh_Cache_Writer::write_array(T *array, int count) {
+  if (count == 0) return 0;
+  u8 line[kMeshCacheAlignment] = {};
+  T *start = (T *)(line + kMeshCacheAlignment);
+  stb__sbm(start) = count;
+  stb__sbn(start) = count;
+  this->pad(kMeshCacheAlignment);
+  this->write(line, kMeshCacheAlignment);
+  u64 result = this->size;
+  this->write(array, count * sizeof(T));
+  return result;
+}
+
+void Mesh_Cache_Writer::add(Model *model) {
+  BVH *bvh = model->bvh;
+  int num_blocks = sb_count(bvh->primitive_ids) / BVH::kBlockSize;
+  Mesh_Cache_Model cached = {};
+  memcpy(cached.name, model->name, sizeof(model->name));
+  if (model->texture != NULL) {
+    snprintf(cached.texture, sizeof(cached.texture), "%s",
+             model->texture->path);
+  }
+  cached.position = model->position;
+  cached.aabb = model->aabb;
+
+  this->pad(kMeshCacheAlignment);
+  cached.data_start = this->size;
+  cached.vertices =
+      this->write_array(model->vertices, sb_count(model->vertices));
+  cached.vns = this->write_array(model->vns, sb_count(model->vns));
+  cached.vts = this->write_array(model->vts, sb_count(model->vts));
+  cached.triangles =
+      this->write_array(model->triangles, sb_count(model->triangles));
+  cached.bvh_nodes = this->write_array(bvh->nodes, sb_count(bvh->nodes));
+  cached.bvh_primitive_ids =
+      this->write_array(bvh->primitive_ids, sb_count(bvh->primitive_ids));
+  cached.bvh_triangle_blocks =
+      this->write_array(bvh->triangle_blocks, num_blocks);
+  cached.data_end = this->size;
+  sb_push(this->models, cached);
+}
+
+void Mesh_Cache_Writer::end(Mapped_File *source,
+                            Mesh_Cache_Library *libraries) {
+  Mesh_Cache_Header header = {};
+  header.magic = Mesh_Cache_Header::kMagic;
+  header.version = Mesh_Cache_Header::kVersion;
+  header.source_size = source->size;
+  header.source_time = source->modified_time;
+  header.source_hash = hash_file_contents(source->data, source->size);
+  header.num_models = sb_count(this->models);
+  header.num_libraries = sb_count(libraries);
+  this->pad(kMeshCacheAlignment);
+  header.models_offset = this->size;
+  this->write(this->models, header.num_models * sizeof(Mesh_Cache_Model));
+  header.libraries_offset = this->size;
+  this->write(libraries, header.num_libraries * sizeof(Mesh_Cache_Library));
+  header.file_size = this->size;
+  fseek(this->file, 0, SEEK_SET);
+  this->write(&header, sizeof(header));
+  fclose(this->file);
+  sb_free(this->models);
+
+  // Not being able to write the cache only makes the next start slower
+  if (this->failed) {
+    printf("Can't write mesh cache %s\n", this->filename);
+    remove(this->filename);
+  }
+}
+
+void save_mesh_cache(char *filename, Mapped_File *source, Model *models,
+                     int num_models, Mesh_Cache_Library *libraries) {
+  Mesh_Cache_Writer writer;
+  if (!writer.begin(filename)) return;
+  for (int i = 0; i < num_models; ++i) {
+    writer.add(models + i);
+  }
+  writer.end(source, libraries);
+}
+
+// Records a library once, file is NULL if it couldn't be read
+void add_mesh_cache_library(Mesh_Cache_Library **libraries, char *path,
+                            Mapped_File *file) {
+  for (int i = 0; i < sb_count(*libraries); ++i) {
+    if (strcmp((*libraries)[i].path, path) == 0) return;
+  }
+  Mesh_Cache_Library library = {};
+  snprintf(library.path, sizeof(library.path), "%s", path);
+  library.size = Mesh_Cache_Library::kMissing;
+  if (file != NULL) {
+    library.size = file->size;
+    library.time = file->modified_time;
+    library.hash = hash_file_contents(file->data, file->size);
+  }
+  sb_push(*libraries, library);
+}
+
+// Libraries are compared like the source, but they are small, so a new
+// time is not written back
+bool mesh_cache_library_is_valid(Mesh_Cache_Library *library) {
+  Mapped_File file;
+  if (!file.map(library->path)) {
+    return library->size == Mesh_Cache_Library::kMissing;
+  }
+  bool valid = library->size == file.size &&
+               (library->time == file.modified_time ||
+                library->hash == hash_file_contents(file.data, file.size));
+  file.unmap();
+  return valid;
+}
+
+bool mesh_cache_is_valid(char *filename, Mesh_Cache_Header *header,
+                         u64 cache_size, Mapped_File *source) {
+  bool valid = header->magic == Mesh_Cache_Header::kMagic &&
+               header->version == Mesh_Cache_Header::kVersion &&
+               header->file_size == cache_size &&
+               header->source_size == source->size &&
+               header->models_offset +
+                       header->num_models * sizeof(Mesh_Cache_Model) <=
+                   cache_size &&
+               header->libraries_offset +
+                       header->num_libraries * sizeof(Mesh_Cache_Library) <=
+                   cache_size;
+  Mesh_Cache_Library *libraries =
+      (Mesh_Cache_Library *)((char *)header + header->libraries_offset);
+  for (int i = 0; valid && i < header->num_libraries; ++i) {
+    valid = mesh_cache_library_is_valid(libraries + i);
+  }
+  if (valid && header->source_time != source->modified_time) {
+    // Could have been touched or copied without changing
+    valid = header->source_hash ==
+            hash_file_contents(source->data, source->size);
+    if (valid) {
+      // So that the next time it's matched by the time again
+      FILE *f = fopen(filename, "r+b");
+      if (f != NULL) {
+        fseek(f, offsetof(Mesh_Cache_Header, source_time), SEEK_SET);
+        fwrite(&source->modified_time, sizeof(u64), 1, f);
+        fclose(f);
+      }
+    }
+  }
+  return valid;
+}
+
+// Points the model at its arrays, which start at data
+void use_cached_geometry(Model *model, Mesh_Cache_Model *cached,
+                         char *data) {
+  char *base = data - cached->data_start;
+#define CACHED_ARRAY(type, offset) \
+  ((offset) != 0 ? (type *)(base + (offset)) : NULL)
+  model->vertices = CACHED_ARRAY(v3, cached->vertices);
+  model->vns = CACHED_ARRAY(v3, cached->vns);
+  model->vts = CACHED_ARRAY(v2, cached->vts);
+  model->triangles = CACHED_ARRAY(Triangle, cached->triangles);
+  model->bvh->nodes = CACHED_ARRAY(BVH_Node, cached->bvh_nodes);
+  model->bvh->primitive_ids = CACHED_ARRAY(int, cached->bvh_primitive_ids);
+  model->bvh->triangle_blocks =
+      CACHED_ARRAY(BVH_Triangle4, cached->bvh_triangle_blocks);
+#undef CACHED_ARRAY
+}
+
+// Pushes the models of the cache if it's valid for the source. They
+// use the mapped cache, which must stay mapped while they exist. Their
+// textures are requested from the texture cache
+bool load_mesh_cache(char *filename, Mapped_File *source, Mapped_File *cache,
+                     Model **models, Texture_Cache *textures) {
+  if (!cache->map(filename)) return false;
+
+  Mesh_Cache_Header *header = (Mesh_Cache_Header *)cache->data;
+  if (cache->size < sizeof(*header) ||
+      !mesh_cache_is_valid(filename, header, cache->size, source)) {
+    cache->unmap();
+    return false;
+  }
+
+  Mesh_Cache_Model *cached =
+      (Mesh_Cache_Model *)(cache->data + header->models_offset);
+  for (int i = 0; i < header->num_models; ++i) {
+    Model model = {};
+    model.set_defaults();
+    memcpy(model.name, cached[i].name, sizeof(model.name));
+    model.position = cached[i].position;
+    model.aabb = cached[i].aabb;
+    model.is_mapped = true;
+    if (cached[i].texture[0] != '\0') {
+      model.texture = textures->request(cached[i].texture);
+    }
+    model.bvh = (BVH *)malloc(sizeof(*model.bvh));
+    use_cached_geometry(&model, cached + i,
+                        cache->data + cached[i].data_start);
+    sb_push(*models, model);
+  }
+  return true;
+}
@@ -0,0 +1,85 @@
+#ifndef ED_MESH_CACHE_H
+#define ED_MESH_CACHE_H
+
+// Models of an OBJ file in binary form, saved next to the file with
+// MESH_CACHE_EXTENSION appended. The arrays are stored as stretchy
+// buffers aligned to cache lines, so that the models of a mapped cache
+// point straight into it. A cache is used while the source and the
+// material libraries it read have the same size and modification time,
+// or failing that the same contents
+#define MESH_CACHE_EXTENSION ".edcache"
+
+struct Mesh_Cache_Header {
+  static const u32 kMagic = 0x48534D45;  // "EMSH"
+  static const u32 kVersion = 3;
+
+  u32 magic;
+  u32 version;
+  u64 file_size;  // of the cache, catches partly written ones
+  u64 source_size;
+  u64 source_time;
+  u64 source_hash;
+  u64 models_offset;  // the tables of models and libraries are last
+  u64 libraries_offset;
+  i32 num_models;
+  i32 num_libraries;
+};
+
+// A material library read while the models were made. Libraries which
+// couldn't be read are saved too, with kMissing as their size
+struct Mesh_Cache_Library {
+  static const u64 kMissing = ~0ull;
+
+  char path[1024];
+  u64 size;
+  u64 time;
+  u64 hash;
+};
+
+// Offsets of the arrays from the start of the cache, 0 for empty ones.
+// All the arrays of a model are between data_start and data_end, so
+// that it can also be read on its own. Meshes and BVHs are in model
+// space, already recentered. Textures are saved by their paths
+struct Mesh_Cache_Model {
+  char name[Model::kMaxNameLength + 1];
+  char texture[260];  // empty if untextured
+  v3 position;
+  AABBox aabb;
+  u64 data_start;
+  u64 data_end;
+  u64 vertices;
+  u64 vns;
+  u64 vts;
+  u64 triangles;
+  u64 bvh_nodes;
+  u64 bvh_primitive_ids;
+  u64 bvh_triangle_blocks;
+};
+
+// Writes a cache one model at a time, so only the model being written
+// has to be in memory
+struct Mesh_Cache_Writer {
+  FILE *file;
+  char *filename;
+  u64 size;
+  Mesh_Cache_Model *models;
+  bool failed;
+
+  bool begin(char *);
+  void add(Model *);
+  void end(Mapped_File *, Mesh_Cache_Library *);
+  void write(void *, u64);
+  void pad(u64);
+  template <typename T>
+  u64 write_array(T *, int);
+};
+
+void add_mesh_cache_library(Mesh_Cache_Library **, char *, Mapped_File *);
+bool mesh_cache_is_valid(char *, Mesh_Cache_Header *, u64, Mapped_File *);
+void use_cached_geometry(Model *, Mesh_Cache_Model *, char *);
+bool load_mesh_cache(char *, Mapped_File *, Mapped_File *, Model **,
+                     Texture_Cache *);
+void save_mesh_cache(char *, Mapped_File *, Model *, int,
+                     Mesh_Cache_Library *);
+
+#endif  // ED_MESH_CACHE_H
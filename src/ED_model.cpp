@@ -1,36 +1,29 @@
-
-void Model::read_texture(char *filename) {
-  Image image = {};
-  image.data = (u32 *)stbi_load(filename, &image.width, &image.height,
-                                &image.bytes_per_pixel, 4);
-  if (image.bytes_per_pixel < 3 || image.bytes_per_pixel > 4) {
-    printf("Image format not supported: %s\n", filename);
-    exit(1);
-  }
-  if (image.data == NULL) {
-    printf("Can't read texture file %s\n", filename);
-    exit(1);
-  }
-  this->texture = image;
-}
-
 void Model::update_aabb(bool transformed) {
   v3 min = V3(INFINITY, INFINITY, INFINITY);
   v3 max = V3(-INFINITY, -INFINITY, -INFINITY);
   m4x4 Transform = Matrix::frame_to_canonical(this->get_basis(), V3(0, 0, 0)) *
                    Matrix::S(this->scale);
-  for (int i = 0; i < sb_count(this->vertices); ++i) {
-    v3 vertex = this->vertices[i];
+  const int kBatchSize = 256;
+  v3 batch[kBatchSize];
+  int num_vertices = sb_count(this->vertices);
+  for (int first = 0; first < num_vertices; first += kBatchSize) {
+    int count = num_vertices - first;
+    if (count > kBatchSize) count = kBatchSize;
+    v3 *points = this->vertices + first;
     if (transformed) {
-      vertex = Transform * vertex;
+      Matrix::transform_points(Transform, points, count, batch);
+      points = batch;
     }
 
-    for (int j = 0; j < 3; ++j) {
-      r32 value = vertex.E[j];
-      if (value < min.E[j]) {
-        min.E[j] = value;
-      } else if (max.E[j] < value) {
-        max.E[j] = value;
+    for (int i = 0; i < count; ++i) {
+      v3 vertex = points[i];
+      for (int j = 0; j < 3; ++j) {
+        r32 value = vertex.E[j];
+        if (value < min.E[j]) {
+          min.E[j] = value;
+        } else if (max.E[j] < value) {
+          max.E[j] = value;
+        }
       }
     }
   }
@@ -40,33 +33,84 @@ void Model::update_aabb(bool transformed) {
 
 void Model::set_defaults() {
   this->triangles = NULL;
+  this->bvh = NULL;
   this->vertices = NULL;
   this->vts = NULL;
   this->vns = NULL;
+  this->texture = NULL;
   this->scale = 1.0f;
   this->direction = V3(0, 0, 1);
   this->display = true;
   this->debug = false;
+  this->is_instance = false;
+  this->is_mapped = false;
+  this->is_streamed = false;
+  this->cull_backfaces = true;
 }
 
 void Model::destroy() {
-  sb_free(this->vertices);
-  sb_free(this->vns);
-  sb_free(this->vts);
-  sb_free(this->triangles);
+  if (this->is_instance) return;  // geometry is owned by the original
+  bool owns_geometry = !this->is_mapped && !this->is_streamed;
+  if (owns_geometry) {
+    sb_free(this->vertices);
+    sb_free(this->vns);
+    sb_free(this->vts);
+    sb_free(this->triangles);
+  }
+  if (this->bvh != NULL) {
+    if (owns_geometry) this->bvh->destroy();
+    free(this->bvh);
+  }
 }
 
 m4x4 Model::get_transform_matrix() {
   if (this->transform_calculated) {
     return this->TransformMatrix;
   }
-  this->TransformMatrix =
-      Matrix::frame_to_canonical(this->get_basis(), this->position) *
-      Matrix::S(this->scale);
+  basis3 basis = this->get_basis();
+  this->TransformMatrix = Matrix::frame_to_canonical(basis, this->position) *
+                          Matrix::S(this->scale);
+  this->InverseTransformMatrix =
+      Matrix::S(1.0f / this->scale) *
+      Matrix::canonical_to_frame(basis, this->position);
   this->transform_calculated = true;
   return this->TransformMatrix;
 }
 
+m4x4 Model::get_inverse_transform_matrix() {
+  this->get_transform_matrix();  // calculates both
+  return this->InverseTransformMatrix;
+}
+
+bool Model::hits(Ray ray, Triangle_Hit *hit, int *triangle_id) {
+  // Trace the ray in model space so that the BVH doesn't have to be
+  // rebuilt when the model moves. The transform is affine, so
+  // the distance along the ray stays the same
+  m4x4 InverseTransform = this->get_inverse_transform_matrix();
+  Ray model_ray;
+  model_ray.origin = InverseTransform * ray.origin;
+  model_ray.direction = V3(InverseTransform * V4_v(ray.direction));
+  return this->bvh->intersect(model_ray, hit, triangle_id);
+}
+
+int Model::hits_packet(Ray_Packet *packet, v4 active, Packet_Hit *hit) {
+  // Same as above, for all lanes at once
+  m4x4 M = this->get_inverse_transform_matrix();
+  Ray_Packet model_packet;
+  for (int i = 0; i < 3; ++i) {
+    v4 *o = packet->origin;
+    v4 *d = packet->direction;
+    model_packet.origin[i] = v4(M.E[4 * i + 0]) * o[0] +
+                             v4(M.E[4 * i + 1]) * o[1] +
+                             v4(M.E[4 * i + 2]) * o[2] + v4(M.E[4 * i + 3]);
+    model_packet.direction[i] = v4(M.E[4 * i + 0]) * d[0] +
+                                v4(M.E[4 * i + 1]) * d[1] +
+                                v4(M.E[4 * i + 2]) * d[2];
+    model_packet.inv_direction[i] = v4(1.0f) / model_packet.direction[i];
+  }
+  return this->bvh->intersect_packet(&model_packet, active, hit);
+}
+
 m4x4 Entity::transform_to_entity_space() {
   m4x4 result;
   basis3 basis = this->get_basis();
@@ -167,53 +211,6 @@ r32 Camera::distance_to_pivot() {
   return result;
 }
 
-Triangle_Hit Ray::hits_triangle(v3 vertices[]) {
-  Triangle_Hit result;
-
-  v3 a = vertices[0];
-  v3 b = vertices[1];
-  v3 c = vertices[2];
-
-  // clang-format off
-  m3x3 A = {
-    a.x - b.x, a.x - c.x, this->direction.x,
-    a.y - b.y, a.y - c.y, this->direction.y,
-    a.z - b.z, a.z - c.z, this->direction.z,
-  };
-  // clang-format on
-
-  r32 D = A.determinant();
-  if (D == 0) {
-    result.at = -1;
-    return result;
-  }
-  v3 R = {a.x - this->origin.x, a.y - this->origin.y, a.z - this->origin.z};
-
-  // Use Cramer's rule to find t, beta, and gamma
-  m3x3 A2 = A.replace_column(2, R);
-  r32 t = A2.determinant() / D;
-  if (t <= 0) {
-    result.at = -1;
-    return result;
-  }
-  r32 gamma = A.replace_column(1, R).determinant() / D;
-  if (gamma < 0 || gamma > 1) {
-    result.at = -1;
-    return result;
-  }
-  r32 beta = A.replace_column(0, R).determinant() / D;
-  if (beta < 0 || beta > (1 - gamma)) {
-    result.at = -1;
-    return result;
-  }
-
-  result.at = t;
-  result.barycentric[0] = 1.0f - beta - gamma;
-  result.barycentric[1] = beta;
-  result.barycentric[2] = gamma;
-  return result;
-}
-
 bool Ray::hits_aabb(AABBox aabb) {
   v3 ray_inv_direction = 1.0f / this->direction;
 
@@ -1,20 +1,16 @@
 #ifndef ED_MODEL_H
 #define ED_MODEL_H
 
+// Corner of a face as written in the obj file
 struct Vertex {
   int index;
   int vt_index;
   int vn_index;
 };
 
+// Indices into the vertices, vns and vts of the model
 struct Triangle {
-  Vertex vertices[3];
-};
-
-struct Fan {
-  static const int kMaxNumVertices = 8;
-  int num_vertices;
-  Vertex vertices[kMaxNumVertices];
+  int indices[3];
 };
 
 struct Triangle_Hit {
@@ -36,12 +32,18 @@ struct AABBox {
   v3 max;
 };
 
+struct Ray;
+struct BVH;
+struct Ray_Packet;
+struct Packet_Hit;
+
 struct Model : Entity {
-  v3 *vertices;
+  v3 *vertices;  // vertices, vns and vts have the same count
   v3 *vns;
   v2 *vts;
   Triangle *triangles;
-  Image texture;
+  BVH *bvh;
+  Texture *texture;  // in the texture cache, NULL if untextured
   v3 old_position;
   v3 old_direction;
   static const int kMaxNameLength = 100;
@@ -50,16 +52,23 @@ struct Model : Entity {
   r32 scale = 1.0f;
   bool display = true;
   bool debug = false;
+  bool is_instance = false;  // shares geometry with another model
+  bool is_mapped = false;  // geometry and BVH are in a mapped mesh cache
+  bool is_streamed = false;  // or in a mesh stream, only while loaded
+  bool cull_backfaces = true;  // turned off for open meshes
 
   AABBox aabb;
   m4x4 TransformMatrix;
+  m4x4 InverseTransformMatrix;
   bool transform_calculated = false;
 
-  void read_texture(char *);
   void update_aabb(bool);
   void set_defaults();
   void destroy();
   m4x4 get_transform_matrix();
+  m4x4 get_inverse_transform_matrix();
+  bool hits(Ray, Triangle_Hit *, int *);
+  int hits_packet(Ray_Packet *, v4, Packet_Hit *);
 };
 
 struct Ray {
@@ -67,7 +76,6 @@ struct Ray {
   v3 direction;
 
   v3 get_point_at(r32 t);
-  Triangle_Hit hits_triangle(v3 vertices[3]);
   bool hits_aabb(AABBox);
 };
 
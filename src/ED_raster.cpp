@@ -0,0 +1,406 @@
+void raster_transform_job(void *data, int) {
+  Raster_Job *job = (Raster_Job *)data;
+  job->rasterizer->transform_vertices(job->rasterizer->chunks + job->index);
+}
+
+void raster_bin_job(void *data, int) {
+  Raster_Job *job = (Raster_Job *)data;
+  job->rasterizer->bin_chunk(job->rasterizer->chunks + job->index);
+}
+
+void raster_tile_job(void *data, int thread_index) {
+  Raster_Job *job = (Raster_Job *)data;
+  job->rasterizer->draw_tile(job->index,
+                             job->rasterizer->tiles + thread_index);
+}
+
+// Uses the AVX2 rasterizer if the CPU has it, unless ED_NO_AVX2 is set
+void Rasterizer::init() {
+  this->rasterize_triangle = triangle_rasterize_simd<false>;
+  this->rasterize_textured_triangle = triangle_rasterize_simd<true>;
+  if (cpu_supports_avx2() && getenv("ED_NO_AVX2") == NULL) {
+    this->rasterize_triangle = triangle_rasterize_avx2<false>;
+    this->rasterize_textured_triangle = triangle_rasterize_avx2<true>;
+  }
+}
+
+// Models with a texture are textured unless `use_textures` is false
+void Rasterizer::begin(Area *target_area, r32 *target_z_buffer,
+                       m4x4 ClipSpaceTransform, v3 light_direction,
+                       bool use_textures) {
+  this->area = target_area;
+  this->z_buffer = target_z_buffer;
+  this->clip_transform = ClipSpaceTransform;
+  this->viewport = Matrix::viewport(0, 0, target_area->get_width(),
+                                    target_area->get_height());
+  this->light_dir = light_direction.normalized();
+  this->textured = use_textures;
+
+  int size = Raster_Tile::kSize;
+  this->num_tiles_x = (target_area->get_width() + size - 1) / size;
+  this->num_tiles_y = (target_area->get_height() + size - 1) / size;
+  this->num_chunks = 0;
+  this->num_vertices = 0;
+}
+
+// Splits the model's triangles into chunks, and its vertices evenly
+// between them. They are transformed and binned later in draw()
+void Rasterizer::add_model(Model *model) {
+  model->get_transform_matrix();  // so that the jobs only read it
+  int num_triangles = sb_count(model->triangles);
+  int num_model_vertices = sb_count(model->vertices);
+  int num_model_chunks = (num_triangles + kChunkSize - 1) / kChunkSize;
+  if (num_model_chunks == 0) return;
+  int vertices_per_chunk =
+      (num_model_vertices + num_model_chunks - 1) / num_model_chunks;
+
+  if (this->num_vertices + num_model_vertices > this->vertices_capacity) {
+    this->vertices_capacity = max(this->num_vertices + num_model_vertices,
+                                  2 * this->vertices_capacity);
+    this->vertices = (Raster_Vertex *)realloc(
+        this->vertices, this->vertices_capacity * sizeof(Raster_Vertex));
+  }
+
+  for (int first = 0; first < num_triangles; first += kChunkSize) {
+    if (this->num_chunks == this->chunks_capacity) {
+      int new_capacity = this->chunks_capacity ? 2 * this->chunks_capacity : 16;
+      this->chunks = (Raster_Chunk *)realloc(
+          this->chunks, new_capacity * sizeof(*this->chunks));
+      memset(this->chunks + this->chunks_capacity, 0,
+             (new_capacity - this->chunks_capacity) * sizeof(*this->chunks));
+      this->chunks_capacity = new_capacity;
+    }
+    Raster_Chunk *chunk = this->chunks + this->num_chunks++;
+    chunk->model = model;
+    chunk->first_triangle = first;
+    chunk->num_triangles = min(kChunkSize, num_triangles - first);
+    chunk->vertex_base = this->num_vertices;
+    chunk->first_vertex =
+        min(first / kChunkSize * vertices_per_chunk, num_model_vertices);
+    chunk->num_vertices =
+        min(vertices_per_chunk, num_model_vertices - chunk->first_vertex);
+  }
+  this->num_vertices += num_model_vertices;
+}
+
+// Transforms the chunk's part of the model's vertices into area space
+// and shades them
+void Rasterizer::transform_vertices(Raster_Chunk *chunk) {
+  TIMED_BLOCK();
+
+  Model *model = chunk->model;
+  m4x4 ModelTransform = model->get_transform_matrix();
+  m4x4 ClipSpaceTransform = this->clip_transform;
+  Raster_Vertex *transformed = this->vertices + chunk->vertex_base;
+
+  const int kBatchSize = 256;
+  v3 positions[kBatchSize];
+  v4 clip[kBatchSize];
+  u8 clip_flags[kBatchSize];
+  v3 normals[kBatchSize];
+  int end = chunk->first_vertex + chunk->num_vertices;
+  for (int first = chunk->first_vertex; first < end; first += kBatchSize) {
+    int count = min(kBatchSize, end - first);
+    Matrix::transform_points(ModelTransform, model->vertices + first, count,
+                             positions);
+    Matrix::transform_points(ClipSpaceTransform, positions, count, clip,
+                             clip_flags);
+    Matrix::transform_vectors(ModelTransform, model->vns + first, count,
+                              normals);
+    for (int i = 0; i < count; ++i) {
+      Raster_Vertex *vertex = transformed + first + i;
+      vertex->clip = clip[i];
+      vertex->clip_flags = clip_flags[i];
+      if (!(clip_flags[i] & Clip_Near)) {
+        vertex->position = this->to_area(clip[i]);
+      }
+      vertex->intensity = -normals[i].normalized() * this->light_dir;
+      vertex->uv = model->vts[first + i];
+    }
+  }
+}
+
+// For points in front of the near plane, where w is positive
+v3 Rasterizer::to_area(v4 clip) {
+  v3 ndc = V3(clip.x / clip.w, clip.y / clip.w, clip.z / clip.w);
+  return this->viewport * ndc;
+}
+
+// Sutherland-Hodgman against the near plane z = w. At least one vertex
+// is in front of it, so the result has 3 or 4 vertices
+int Rasterizer::clip_to_near_plane(Raster_Vertex *verts,
+                                   Raster_Vertex *result) {
+  int count = 0;
+  for (int i = 0; i < 3; ++i) {
+    Raster_Vertex *a = verts + i;
+    Raster_Vertex *b = verts + (i + 1) % 3;
+    r32 a_dist = a->clip.w - a->clip.z;
+    r32 b_dist = b->clip.w - b->clip.z;
+    if (a_dist >= 0) {
+      result[count++] = *a;
+    }
+    if ((a_dist >= 0) != (b_dist >= 0)) {
+      r32 t = a_dist / (a_dist - b_dist);
+      Raster_Vertex *vertex = result + count++;
+      vertex->clip = v4_lerp(v4(t), a->clip, b->clip);
+      vertex->position = this->to_area(vertex->clip);
+      vertex->intensity = lerp(a->intensity, b->intensity, t);
+      vertex->uv = V2(lerp(a->uv.u, b->uv.u, t), lerp(a->uv.v, b->uv.v, t));
+      vertex->clip_flags = 0;
+    }
+  }
+  return count;
+}
+
+// Assembles the triangles of the chunk from the transformed vertices,
+// clips and culls them and sorts their ids by tile. Triangles outside
+// one of the planes of the view volume are dropped, and only the ones
+// crossing the near plane are clipped. The other planes are handled by
+// the bounding boxes and edge functions
+void Rasterizer::bin_chunk(Raster_Chunk *chunk) {
+  TIMED_BLOCK();
+
+  Model *model = chunk->model;
+  Raster_Vertex *transformed = this->vertices + chunk->vertex_base;
+  int area_width = this->area->get_width();
+  int area_height = this->area->get_height();
+  int num_tiles = this->num_tiles_x * this->num_tiles_y;
+  Texture *texture = NULL;
+  if (this->textured && model->texture && model->texture->texels) {
+    texture = model->texture;
+  }
+
+  if (chunk->triangles == NULL) {
+    chunk->triangles =
+        (Raster_Triangle *)malloc(2 * kChunkSize * sizeof(Raster_Triangle));
+  }
+  if (chunk->tile_offsets_capacity < num_tiles + 1) {
+    chunk->tile_offsets_capacity = num_tiles + 1;
+    chunk->tile_offsets = (int *)realloc(
+        chunk->tile_offsets, chunk->tile_offsets_capacity * sizeof(int));
+  }
+  int *offsets = chunk->tile_offsets;
+  memset(offsets, 0, (num_tiles + 1) * sizeof(int));
+
+  chunk->num_assembled = 0;
+  for (int i = 0; i < chunk->num_triangles; ++i) {
+    Triangle triangle = model->triangles[chunk->first_triangle + i];
+    Raster_Vertex polygon[4];
+    for (int j = 0; j < 3; ++j) {
+      polygon[j] = transformed[triangle.indices[j]];
+    }
+    u8 flags_and = polygon[0].clip_flags & polygon[1].clip_flags &
+                   polygon[2].clip_flags;
+    u8 flags_or = polygon[0].clip_flags | polygon[1].clip_flags |
+                  polygon[2].clip_flags;
+    if (flags_and) continue;
+
+    int num_corners = 3;
+    if (flags_or & Clip_Near) {
+      Raster_Vertex verts[3] = {polygon[0], polygon[1], polygon[2]};
+      num_corners = this->clip_to_near_plane(verts, polygon);
+    }
+
+    for (int k = 1; k < num_corners - 1; ++k) {
+      Raster_Triangle *tri = chunk->triangles + chunk->num_assembled;
+      Raster_Vertex *corners[3] = {polygon, polygon + k, polygon + k + 1};
+      for (int j = 0; j < 3; ++j) {
+        tri->verts[j] = corners[j]->position;
+        tri->intensity[j] = corners[j]->intensity;
+        tri->inv_w[j] = 1.0f / corners[j]->clip.w;
+        tri->uv[j] = corners[j]->uv;
+      }
+      tri->texture = texture;
+
+      // Front faces are counter-clockwise. Zero area ones have no pixels
+      v3 *v = tri->verts;
+      r32 signed_area = (v[1].x - v[0].x) * (v[2].y - v[0].y) -
+                        (v[1].y - v[0].y) * (v[2].x - v[0].x);
+      if (signed_area == 0) continue;
+      if (signed_area < 0 && model->cull_backfaces) continue;
+
+      // Range of pixels whose centers (integer coordinates) are in the
+      // bounding box, clipped against the area. Empty for the triangles
+      // which fall between the pixels
+      r32 min_x = ceil_r32(min3(v[0].x, v[1].x, v[2].x));
+      r32 min_y = ceil_r32(min3(v[0].y, v[1].y, v[2].y));
+      r32 max_x = floor_r32(max3(v[0].x, v[1].x, v[2].x));
+      r32 max_y = floor_r32(max3(v[0].y, v[1].y, v[2].y));
+      min_x = max(min_x, 0.0f);
+      min_y = max(min_y, 0.0f);
+      max_x = min(max_x, (r32)(area_width - 1));
+      max_y = min(max_y, (r32)(area_height - 1));
+      if (min_x > max_x || min_y > max_y) continue;
+      tri->tile_min = V2i((int)min_x / Raster_Tile::kSize,
+                          (int)min_y / Raster_Tile::kSize);
+      tri->tile_max = V2i((int)max_x / Raster_Tile::kSize,
+                          (int)max_y / Raster_Tile::kSize);
+
+      for (int y = tri->tile_min.y; y <= tri->tile_max.y; ++y) {
+        for (int x = tri->tile_min.x; x <= tri->tile_max.x; ++x) {
+          offsets[y * this->num_tiles_x + x]++;
+        }
+      }
+      chunk->num_assembled++;
+    }
+  }
+
+  // Counts to offsets
+  int total = 0;
+  for (int t = 0; t < num_tiles; ++t) {
+    int count = offsets[t];
+    offsets[t] = total;
+    total += count;
+  }
+  offsets[num_tiles] = total;
+
+  if (chunk->triangle_ids_capacity < total) {
+    chunk->triangle_ids_capacity = max(total, 2 * chunk->triangle_ids_capacity);
+    chunk->triangle_ids = (int *)realloc(
+        chunk->triangle_ids, chunk->triangle_ids_capacity * sizeof(int));
+  }
+
+  // Fill the bins keeping the original order of triangles. Every offset
+  // ends up at the start of the next bin, so shift them back after
+  for (int i = 0; i < chunk->num_assembled; ++i) {
+    Raster_Triangle *tri = chunk->triangles + i;
+    for (int y = tri->tile_min.y; y <= tri->tile_max.y; ++y) {
+      for (int x = tri->tile_min.x; x <= tri->tile_max.x; ++x) {
+        chunk->triangle_ids[offsets[y * this->num_tiles_x + x]++] = i;
+      }
+    }
+  }
+  for (int t = num_tiles; t > 0; --t) {
+    offsets[t] = offsets[t - 1];
+  }
+  offsets[0] = 0;
+}
+
+// Copies the tile from the area, draws its triangles in the order they
+// were added and copies it back
+void Rasterizer::draw_tile(int tile_index, Raster_Tile *tile) {
+  TIMED_BLOCK();
+
+  int size = Raster_Tile::kSize;
+  int tile_x = tile_index % this->num_tiles_x;
+  int tile_y = tile_index / this->num_tiles_x;
+  tile->origin = V2i(tile_x * size, tile_y * size);
+  tile->width = min(size, this->area->get_width() - tile->origin.x);
+  tile->height = min(size, this->area->get_height() - tile->origin.y);
+
+  Pixel_Buffer *buffer = this->area->buffer;
+  int top_row = buffer->height - this->area->bottom - tile->origin.y -
+                tile->height;
+  int first = top_row * buffer->width + this->area->left + tile->origin.x;
+  u32 *pixels = (u32 *)buffer->memory + first;
+  r32 *depth = this->z_buffer + first;
+
+  for (int row = 0; row < tile->height; ++row) {
+    memcpy(tile->pixels + row * size, pixels + row * buffer->width,
+           tile->width * sizeof(u32));
+    memcpy(tile->depth + row * size, depth + row * buffer->width,
+           tile->width * sizeof(r32));
+  }
+
+  for (int row = 0; row < size; ++row) {
+    int start = row < tile->height ? tile->width : 0;
+    for (int x = start; x < size; ++x) {
+      tile->depth[row * size + x] = FLT_MAX;
+    }
+  }
+  tile->update_block_depths((u64)-1);
+  tile->dirty_blocks = 0;
+  int num_drawn = 0;
+
+  for (int c = 0; c < this->num_chunks; ++c) {
+    Raster_Chunk *chunk = this->chunks + c;
+    int end = chunk->tile_offsets[tile_index + 1];
+    for (int i = chunk->tile_offsets[tile_index]; i < end; ++i) {
+      Raster_Triangle *tri = chunk->triangles + chunk->triangle_ids[i];
+      if (tri->texture) {
+        this->rasterize_textured_triangle(tile, tri);
+      } else {
+        this->rasterize_triangle(tile, tri);
+      }
+      if (++num_drawn % Raster_Tile::kBlockUpdateInterval == 0) {
+        tile->update_block_depths(tile->dirty_blocks);
+        tile->dirty_blocks = 0;
+      }
+    }
+  }
+
+  for (int row = 0; row < tile->height; ++row) {
+    memcpy(pixels + row * buffer->width, tile->pixels + row * size,
+           tile->width * sizeof(u32));
+    memcpy(depth + row * buffer->width, tile->depth + row * size,
+           tile->width * sizeof(r32));
+  }
+}
+
+// Recomputes the depth of the blocks whose bits are set
+void Raster_Tile::update_block_depths(u64 blocks) {
+  while (blocks) {
+    int block = lowest_set_bit(blocks);
+    blocks &= blocks - 1;
+
+    r32 *row = this->depth + (block / kBlocks) * kBlockSize * kSize +
+               (block % kBlocks) * kBlockSize;
+    v4 min_depth = v4::loadu(row);
+    for (int y = 0; y < kBlockSize; ++y, row += kSize) {
+      min_depth = vmin(min_depth, vmin(v4::loadu(row), v4::loadu(row + 4)));
+    }
+    this->block_min_depth[block] = min(min(min_depth.x, min_depth.y),
+                                       min(min_depth.z, min_depth.w));
+  }
+}
+
+void Rasterizer::draw(Job_System *job_system) {
+  TIMED_BLOCK();
+
+  if (this->num_tiles_allocated < job_system->num_threads) {
+    free(this->tiles);
+    this->num_tiles_allocated = job_system->num_threads;
+    this->tiles = (Raster_Tile *)malloc(this->num_tiles_allocated *
+                                        sizeof(Raster_Tile));
+  }
+
+  Raster_Job job;
+  job.rasterizer = this;
+  for (int c = 0; c < this->num_chunks; ++c) {
+    job.index = c;
+    job_system->add(raster_transform_job, &job, sizeof(job), &this->jobs);
+  }
+  job_system->wait(&this->jobs);
+
+  for (int c = 0; c < this->num_chunks; ++c) {
+    job.index = c;
+    job_system->add(raster_bin_job, &job, sizeof(job), &this->jobs);
+  }
+  job_system->wait(&this->jobs);
+
+  // Only the tiles which have triangles are drawn
+  int num_tiles = this->num_tiles_x * this->num_tiles_y;
+  for (int t = 0; t < num_tiles; ++t) {
+    bool empty = true;
+    for (int c = 0; c < this->num_chunks && empty; ++c) {
+      int *offsets = this->chunks[c].tile_offsets;
+      empty = offsets[t] == offsets[t + 1];
+    }
+    if (empty) continue;
+    job.index = t;
+    job_system->add(raster_tile_job, &job, sizeof(job), &this->jobs);
+  }
+  job_system->wait(&this->jobs);
+}
+
+void Rasterizer::destroy() {
+  for (int c = 0; c < this->chunks_capacity; ++c) {
+    Raster_Chunk *chunk = this->chunks + c;
+    free(chunk->triangles);
+    free(chunk->tile_offsets);
+    free(chunk->triangle_ids);
+  }
+  free(this->chunks);
+  free(this->vertices);
+  free(this->tiles);
+}
@@ -0,0 +1,117 @@
+#ifndef ED_RASTER_H
+#define ED_RASTER_H
+
+struct Area;
+
+// The 3D view is rasterized in three phases. First every vertex is
+// transformed once. Then the triangles are assembled from the indices,
+// clipped and binned into screen tiles, in chunks of kChunkSize
+// triangles. Finally every tile is drawn by one thread into its own
+// copy of the color and depth, so no synchronization is needed per pixel
+
+struct Raster_Vertex {
+  v4 clip;        // in clip space
+  v3 position;    // in area coordinates, unless beyond the near plane
+  r32 intensity;  // Gouraud shading
+  v2 uv;
+  u8 clip_flags;
+};
+
+struct Raster_Triangle {
+  v3 verts[3];       // in area coordinates
+  r32 intensity[3];  // Gouraud shading at the vertices
+  r32 inv_w[3];      // for perspective correct texture coordinates
+  v2 uv[3];
+  Texture *texture;  // NULL for the grey triangles
+  v2i tile_min;      // range of tiles covered by the bounding box
+  v2i tile_max;
+};
+
+struct Raster_Chunk {
+  Model *model;
+  int first_triangle;
+  int num_triangles;
+  int vertex_base;   // where the model's transformed vertices start
+  int first_vertex;  // the part of the model's vertices transformed
+  int num_vertices;  // by this chunk
+
+  Raster_Triangle *triangles;  // 2 * kChunkSize after clipping
+  int num_assembled;
+  int *tile_offsets;           // bins of triangle ids, num_tiles + 1
+  int *triangle_ids;           // grouped by tile
+  int tile_offsets_capacity;
+  int triangle_ids_capacity;
+};
+
+// Color and depth of one tile with the top row first. The parts
+// outside the area have the nearest possible depth and are never drawn
+struct Raster_Tile {
+  static const int kSize = 64;  // multiple of 8 so that rows are aligned
+  static const int kBlockSize = 8;
+  static const int kBlocks = kSize / kBlockSize;  // per side, 64 in total
+
+  u32 pixels[kSize * kSize];
+  r32 depth[kSize * kSize];
+  v2i origin;  // bottom left corner in area coordinates
+  int width;
+  int height;
+
+  // Farthest depth in every 8x8 block. Triangles which are farther
+  // than that everywhere can skip the block. The depth only grows, so
+  // it stays a safe bound until the changed blocks are updated
+  r32 block_min_depth[kBlocks * kBlocks];
+  u64 dirty_blocks;
+
+  static const int kBlockUpdateInterval = 32;  // in triangles
+
+  void update_block_depths(u64);
+};
+
+typedef void Triangle_Rasterize_Function(Raster_Tile *, Raster_Triangle *);
+
+struct Rasterizer {
+  static const int kChunkSize = 4096;
+
+  // Chosen by init()
+  Triangle_Rasterize_Function *rasterize_triangle;
+  Triangle_Rasterize_Function *rasterize_textured_triangle;
+
+  // Set up by begin()
+  Area *area;
+  r32 *z_buffer;
+  m4x4 clip_transform;
+  m4x4 viewport;
+  v3 light_dir;
+  bool textured;
+  int num_tiles_x;
+  int num_tiles_y;
+
+  Raster_Chunk *chunks;  // reused between frames
+  int num_chunks;
+  int chunks_capacity;
+  Raster_Vertex *vertices;  // of all models added since begin()
+  int num_vertices;
+  int vertices_capacity;
+  Raster_Tile *tiles;  // scratch by thread index
+  int num_tiles_allocated;
+  Job_Group jobs;
+
+  void init();
+  void begin(Area *, r32 *, m4x4, v3, bool);
+  void add_model(Model *);
+  void draw(Job_System *);
+  void transform_vertices(Raster_Chunk *);
+  void bin_chunk(Raster_Chunk *);
+  v3 to_area(v4);
+  int clip_to_near_plane(Raster_Vertex *, Raster_Vertex *);
+  void draw_tile(int, Raster_Tile *);
+  void destroy();
+};
+
+// Chunk index for transforming and binning, tile index for drawing
+struct Raster_Job {
+  Rasterizer *rasterizer;
+  int index;
+};
+
+#endif  // ED_RASTER_H
@@ -0,0 +1,483 @@
+// Triangles of an object which is being cut into chunks
+struct Stream_Build {
+  Model *object;
+  int *triangle_ids;
+  v2i *ranges;  // first id and number of triangles of every chunk
+  Model *chunks;
+};
+
+struct Stream_Build_Job {
+  Stream_Build *build;
+  int index;
+};
+
+// Three times the centroid, which is the same for comparisons
+inline v3 triangle_centroid(Model *model, int triangle_id) {
+  int *indices = model->triangles[triangle_id].indices;
+  return model->vertices[indices[0]] + model->vertices[indices[1]] +
+         model->vertices[indices[2]];
+}
+
+// Halves the triangles at the middle of the longest axis of their
+// centroids until there are few enough of them for a chunk
+void split_stream_chunks(Stream_Build *build, int first, int count) {
+  if (count <= Mesh_Stream::kMaxChunkTriangles) {
+    sb_push(build->ranges, V2i(first, count));
+    return;
+  }
+
+  int *ids = build->triangle_ids + first;
+  AABBox bounds = aabb_empty();
+  for (int i = 0; i < count; ++i) {
+    aabb_grow(&bounds, triangle_centroid(build->object, ids[i]));
+  }
+  v3 extent = bounds.max - bounds.min;
+  int axis = 0;
+  if (extent.y > extent.E[axis]) axis = 1;
+  if (extent.z > extent.E[axis]) axis = 2;
+  r32 middle = 0.5f * (bounds.min.E[axis] + bounds.max.E[axis]);
+
+  int left = 0;
+  int right = count;
+  while (left < right) {
+    if (triangle_centroid(build->object, ids[left]).E[axis] < middle) {
+      ++left;
+    } else {
+      --right;
+      int id = ids[left];
+      ids[left] = ids[right];
+      ids[right] = id;
+    }
+  }
+  if (left == 0 || left == count) left = count / 2;  // all in one place
+
+  split_stream_chunks(build, first, left);
+  split_stream_chunks(build, first + left, count - left);
+}
+
+// Copies the triangles of a chunk and the vertices they use, and makes
+// it a model of its own
+void make_stream_chunk_job(void *data, int) {
+  Stream_Build_Job *job = (Stream_Build_Job *)data;
+  Stream_Build *build = job->build;
+  Model *object = build->object;
+  Model *chunk = build->chunks + job->index;
+  int *ids = build->triangle_ids + build->ranges[job->index].x;
+  int num_triangles = build->ranges[job->index].y;
+
+  chunk->set_defaults();
+  memcpy(chunk->name, object->name, sizeof(chunk->name));
+  chunk->texture = object->texture;
+  chunk->cull_backfaces = object->cull_backfaces;
+
+  // Vertices of the object which are already in the chunk
+  int table_size = 16;
+  while (table_size < 6 * num_triangles) table_size *= 2;
+  int *table = (int *)malloc(table_size * sizeof(int));
+  for (int i = 0; i < table_size; ++i) table[i] = -1;
+  int *sources = NULL;
+
+  sb_add(chunk->triangles, num_triangles);
+  for (int t = 0; t < num_triangles; ++t) {
+    for (int k = 0; k < 3; ++k) {
+      int vertex = object->triangles[ids[t]].indices[k];
+      int slot = ((u32)vertex * 2654435761u) & (table_size - 1);
+      while (table[slot] >= 0 && sources[table[slot]] != vertex) {
+        slot = (slot + 1) & (table_size - 1);
+      }
+      if (table[slot] < 0) {
+        table[slot] = sb_count(sources);
+        sb_push(sources, vertex);
+        sb_push(chunk->vertices, object->vertices[vertex]);
+        sb_push(chunk->vns, object->vns[vertex]);
+        sb_push(chunk->vts, object->vts[vertex]);
+      }
+      chunk->triangles[t].indices[k] = table[slot];
+    }
+  }
+  sb_free(sources);
+  free(table);
+
+  // The object is at the origin, so the chunk ends up where it is in
+  // the file
+  center_and_build_bvh(chunk);
+}
+
+// Cuts the part of an object with one material into chunks and writes
+// them
+void write_stream_model(Mesh_Cache_Writer *writer, Model *object,
+                        Obj_File *file, Obj_Counts start, Obj_Counts end,
+                        Job_System *jobs) {
+  make_obj_mesh(object, file, start, end);
+
+  Stream_Build build = {};
+  build.object = object;
+  int num_triangles = sb_count(object->triangles);
+  build.triangle_ids = (int *)malloc(num_triangles * sizeof(int));
+  for (int i = 0; i < num_triangles; ++i) build.triangle_ids[i] = i;
+  split_stream_chunks(&build, 0, num_triangles);
+
+  int num_chunks = sb_count(build.ranges);
+  for (int c = 0; c < num_chunks; ++c) {
+    Model chunk = {};
+    sb_push(build.chunks, chunk);
+  }
+  Job_Group group;
+  Stream_Build_Job job;
+  job.build = &build;
+  for (int c = 0; c < num_chunks; ++c) {
+    job.index = c;
+    jobs->add(make_stream_chunk_job, &job, sizeof(job), &group);
+  }
+  jobs->wait(&group);
+
+  for (int c = 0; c < num_chunks; ++c) {
+    writer->add(build.chunks + c);
+    build.chunks[c].destroy();
+  }
+  sb_free(build.chunks);
+  free(build.triangle_ids);
+  sb_free(build.ranges);
+  object->destroy();
+  object->set_defaults();
+}
+
+// Parses an object and writes it like read_wavefront_obj_file splits
+// it into models. The elements before the object are counted in base
+void write_stream_object(Mesh_Cache_Writer *writer, Text_Cursor text,
+                         int number, Obj_Counts *base,
+                         Obj_Materials *materials, Job_System *jobs) {
+  Obj_File file = {};
+  file.filename = materials->filename;
+  file.base = *base;
+  Obj_Counts total = read_obj_elements(&file, text, jobs);
+  base->positions += total.positions;
+  base->vts += total.vts;
+  base->vns += total.vns;
+  base->corners += total.corners;
+
+  Model object = {};
+  object.set_defaults();
+  sprintf(object.name, "Model %d", number);
+  Obj_Counts start = {};
+  for (int c = 0; c < file.num_chunks; ++c) {
+    Obj_Chunk *chunk = file.chunks + c;
+    for (int m = 0; m < sb_count(chunk->markers); ++m) {
+      Obj_Marker *marker = chunk->markers + m;
+      Obj_Counts at = marker->counts;
+      at.positions += chunk->offsets.positions;
+      at.vts += chunk->offsets.vts;
+      at.vns += chunk->offsets.vns;
+      at.corners += chunk->offsets.corners;
+      if (marker->type != Obj_Marker_Library && at.corners > start.corners) {
+        object.texture = materials->current;
+        write_stream_model(writer, &object, &file, start, at, jobs);
+        start = at;
+      }
+      apply_obj_marker(marker, &object, materials);
+    }
+  }
+  if (total.corners > start.corners) {
+    object.texture = materials->current;
+    write_stream_model(writer, &object, &file, start, total, jobs);
+  }
+  free_obj_file(&file);
+}
+
+// Objects only use their own elements, so the file is read one object
+// at a time and only the biggest object has to fit in memory
+bool build_mesh_stream(char *stream_name, char *filename,
+                       Mapped_File *source, Texture_Cache *textures,
+                       Job_System *jobs) {
+  Mesh_Cache_Writer writer;
+  if (!writer.begin(stream_name)) return false;
+
+  Obj_Materials materials = {};
+  materials.filename = filename;
+  materials.textures = textures;
+
+  Text_Cursor cursor = {source->data, source->data + source->size};
+  Obj_Counts base = {};
+  char *object_start = cursor.at;
+  int num_objects = 0;
+  bool has_faces = false;
+  while (cursor.at < cursor.end) {
+    char *line = cursor.at;
+    if (cursor.skip_keyword("f")) {
+      has_faces = true;
+    } else if (has_faces && cursor.skip_keyword("o")) {
+      Text_Cursor object = {object_start, line};
+      write_stream_object(&writer, object, ++num_objects, &base, &materials,
+                          jobs);
+      object_start = line;
+      has_faces = false;
+    }
+    cursor.skip_line();
+  }
+  Text_Cursor object = {object_start, cursor.end};
+  write_stream_object(&writer, object, ++num_objects, &base, &materials,
+                      jobs);
+  sb_free(materials.materials);
+
+  writer.end(source, materials.libraries);
+  sb_free(materials.libraries);
+  return !writer.failed;
+}
+
+// Pushes a model for every chunk of the stream if it's valid for the
+// source. The models have no geometry until their chunks are loaded,
+// but their textures are requested right away
+bool Mesh_Stream::open(Mapped_File *source, Model **models,
+                       Texture_Cache *textures) {
+  if (!this->file.map(this->filename)) return false;
+
+  Mesh_Cache_Header *header = (Mesh_Cache_Header *)this->file.data;
+  bool valid = this->file.size >= sizeof(*header) &&
+               mesh_cache_is_valid(this->filename, header, this->file.size,
+                                   source);
+  Mesh_Cache_Model *cached =
+      valid ? (Mesh_Cache_Model *)(this->file.data + header->models_offset)
+            : NULL;
+  for (int i = 0; valid && i < header->num_models; ++i) {
+    valid = cached[i].data_start <= cached[i].data_end &&
+            cached[i].data_end <= this->file.size;
+  }
+  if (!valid) {
+    this->file.unmap();
+    return false;
+  }
+
+  this->num_chunks = header->num_models;
+  this->chunks = (Stream_Chunk *)calloc(this->num_chunks, sizeof(Stream_Chunk));
+  this->order =
+      (Stream_Chunk **)malloc(this->num_chunks * sizeof(Stream_Chunk *));
+  this->budget = kDefaultBudget;
+  this->resident_size = 0;
+  for (int i = 0; i < this->num_chunks; ++i) {
+    Stream_Chunk *chunk = this->chunks + i;
+    chunk->cached = cached[i];
+    chunk->model_index = sb_count(*models);
+    this->order[i] = chunk;
+
+    Model model = {};
+    model.set_defaults();
+    memcpy(model.name, cached[i].name, sizeof(model.name));
+    model.position = cached[i].position;
+    model.aabb = cached[i].aabb;
+    model.is_streamed = true;
+    if (cached[i].texture[0] != '\0') {
+      model.texture = textures->request(cached[i].texture);
+    }
+    model.bvh = (BVH *)calloc(1, sizeof(*model.bvh));
+    // The box can't be updated without the vertices
+    model.old_position = model.position;
+    model.old_direction = model.direction;
+    sb_push(*models, model);
+  }
+  return true;
+}
+
+struct Stream_Load_Job {
+  Mesh_Stream *stream;
+  int index;
+};
+
+// Copying leaves the mapped pages to the system, which can drop them
+// whenever it needs the memory
+void load_stream_chunk_job(void *data, int) {
+  Stream_Load_Job *job = (Stream_Load_Job *)data;
+  Mesh_Stream *stream = job->stream;
+  Stream_Chunk *chunk = stream->chunks + job->index;
+  u64 size = chunk->cached.data_end - chunk->cached.data_start;
+  chunk->data = (char *)_mm_malloc(size, kMeshCacheAlignment);
+  memcpy(chunk->data, stream->file.data + chunk->cached.data_start, size);
+  atomic_compare_exchange(&chunk->state, Stream_Chunk_Loaded,
+                          Stream_Chunk_Loading);
+}
+
+int compare_stream_chunks(const void *a, const void *b) {
+  Stream_Chunk *chunk_a = *(Stream_Chunk **)a;
+  Stream_Chunk *chunk_b = *(Stream_Chunk **)b;
+  if (chunk_a->visible != chunk_b->visible) return chunk_a->visible ? -1 : 1;
+  if (chunk_a->distance < chunk_b->distance) return -1;
+  return chunk_a->distance > chunk_b->distance;
+}
+
+// Ray trace tiles may be reading the chunks, and their scenes have
+// copies of the geometry pointers, so the renders start over
+void stop_raytrace_renders(Program_State *state) {
+  User_Interface *ui = state->UI;
+  for (int i = 0; i < sb_count(ui->areas); ++i) {
+    ui->areas[i]->editor_raytrace.stop_render(state->jobs);
+  }
+}
+
+// Chunks seen by any of the views come first, nearest first, then the
+// rest by distance. As many of them as fit in the budget are kept in
+// memory
+void Mesh_Stream::update(Program_State *state, Stream_View *views,
+                         int num_views) {
+  this->num_loading = 0;
+  for (int i = 0; i < this->num_chunks; ++i) {
+    Stream_Chunk *chunk = this->chunks + i;
+    Model *model = state->models + chunk->model_index;
+    if (chunk->state == Stream_Chunk_Loaded &&
+        atomic_compare_exchange(&chunk->state, Stream_Chunk_Resident,
+                                Stream_Chunk_Loaded) == Stream_Chunk_Loaded) {
+      use_cached_geometry(model, &chunk->cached, chunk->data);
+      this->has_new_chunks = true;
+    } else if (chunk->state == Stream_Chunk_Loading) {
+      this->num_loading++;
+    }
+
+    chunk->visible = false;
+    chunk->distance = INFINITY;
+    AABBox box = model->aabb;
+    for (int v = 0; v < num_views; ++v) {
+      v3 corners[8];
+      for (int corner = 0; corner < 8; ++corner) {
+        corners[corner].x = (corner & 1) ? box.max.x : box.min.x;
+        corners[corner].y = (corner & 2) ? box.max.y : box.min.y;
+        corners[corner].z = (corner & 4) ? box.max.z : box.min.z;
+      }
+      u8 clip_flags[8];
+      Matrix::transform_points(views[v].clip_transform, corners, 8, corners,
+                               clip_flags);
+      u8 outside_all = 0xFF;
+      for (int corner = 0; corner < 8; ++corner) {
+        outside_all &= clip_flags[corner];
+      }
+      if (!outside_all) chunk->visible = true;
+
+      v3 position = views[v].position;
+      v3 closest;
+      for (int j = 0; j < 3; ++j) {
+        closest.E[j] = min(max(position.E[j], box.min.E[j]), box.max.E[j]);
+      }
+      chunk->distance = min(chunk->distance, (position - closest).len());
+    }
+  }
+
+  qsort(this->order, this->num_chunks, sizeof(*this->order),
+        compare_stream_chunks);
+  u64 available = this->budget;
+  for (int i = 0; i < this->num_chunks; ++i) {
+    Stream_Chunk *chunk = this->order[i];
+    u64 size = chunk->cached.data_end - chunk->cached.data_start;
+    chunk->wanted = state->models[chunk->model_index].display &&
+                    size <= available;
+    if (chunk->wanted) available -= size;
+  }
+
+  bool renders_stopped = false;
+  for (int i = 0; i < this->num_chunks; ++i) {
+    Stream_Chunk *chunk = this->chunks + i;
+    if (chunk->wanted || chunk->state != Stream_Chunk_Resident) continue;
+    if (!renders_stopped) {
+      stop_raytrace_renders(state);
+      renders_stopped = true;
+    }
+    Model *model = state->models + chunk->model_index;
+    model->vertices = NULL;
+    model->vns = NULL;
+    model->vts = NULL;
+    model->triangles = NULL;
+    model->bvh->nodes = NULL;
+    model->bvh->primitive_ids = NULL;
+    model->bvh->triangle_blocks = NULL;
+    _mm_free(chunk->data);
+    chunk->data = NULL;
+    chunk->state = Stream_Chunk_Unloaded;
+    this->resident_size -= chunk->cached.data_end - chunk->cached.data_start;
+  }
+
+  Stream_Load_Job job;
+  job.stream = this;
+  for (int i = 0; i < this->num_chunks; ++i) {
+    if (this->num_loading >= kMaxLoadsInFlight) break;
+    Stream_Chunk *chunk = this->order[i];
+    u64 size = chunk->cached.data_end - chunk->cached.data_start;
+    if (!chunk->wanted || chunk->state != Stream_Chunk_Unloaded ||
+        this->resident_size + size > this->budget) {
+      continue;
+    }
+    chunk->state = Stream_Chunk_Loading;
+    this->resident_size += size;
+    job.index = (int)(chunk - this->chunks);
+    state->jobs->add(load_stream_chunk_job, &job, sizeof(job), &this->loads);
+    this->num_loading++;
+  }
+}
+
+void Mesh_Stream::destroy(Job_System *jobs) {
+  jobs->wait(&this->loads);
+  for (int i = 0; i < this->num_chunks; ++i) {
+    if (this->chunks[i].data != NULL) _mm_free(this->chunks[i].data);
+  }
+  free(this->chunks);
+  free(this->order);
+  this->file.unmap();
+}
+
+// The stream is made on the first start, which takes a while
+void Program_State::open_mesh_stream(char *filename, Mapped_File *source) {
+  Mesh_Stream *stream = (Mesh_Stream *)calloc(1, sizeof(*stream));
+  snprintf(stream->filename, sizeof(stream->filename),
+           "%s" MESH_STREAM_EXTENSION, filename);
+  if (!stream->open(source, &this->models, this->textures)) {
+    if (!build_mesh_stream(stream->filename, filename, source, this->textures,
+                           this->jobs) ||
+        !stream->open(source, &this->models, this->textures)) {
+      printf("Can't make mesh stream %s\n", stream->filename);
+      exit(1);
+    }
+  }
+  sb_push(this->mesh_streams, stream);
+
+  Job_Group group;
+  this->textures->load_requested(this->jobs, &group);
+  this->jobs->wait(&group);
+}
+
+// Every visible area has a camera, also when it's ray tracing
+void update_mesh_streams(Program_State *state) {
+  if (state->mesh_streams == NULL) return;
+
+  User_Interface *ui = state->UI;
+  Stream_View *views = NULL;
+  for (int i = 0; i < sb_count(ui->areas); ++i) {
+    Area *area = ui->areas[i];
+    if (!area->is_visible()) continue;
+    Camera *camera = &area->editor_3dview.camera;
+    Stream_View view;
+    view.clip_transform =
+        camera->projection_matrix() * camera->transform_to_entity_space();
+    view.position = camera->position;
+    sb_push(views, view);
+  }
+
+  bool loading = false;
+  bool has_new_chunks = false;
+  for (int i = 0; i < sb_count(state->mesh_streams); ++i) {
+    Mesh_Stream *stream = state->mesh_streams[i];
+    stream->update(state, views, sb_count(views));
+    if (stream->num_loading > 0) loading = true;
+    if (stream->has_new_chunks) has_new_chunks = true;
+  }
+  sb_free(views);
+
+  // Renders only have the chunks which were there when they started.
+  // Chunks arrive a few at a time, so the renders restart once all the
+  // loads are done rather than for every chunk
+  if (has_new_chunks && !loading) {
+    for (int i = 0; i < sb_count(state->mesh_streams); ++i) {
+      state->mesh_streams[i]->has_new_chunks = false;
+    }
+    for (int i = 0; i < sb_count(ui->areas); ++i) {
+      Area *area = ui->areas[i];
+      if (area->editor_type == Area_Editor_Type_Raytrace) {
+        area->editor_raytrace.needs_redraw = true;
+      }
+    }
+  }
+}
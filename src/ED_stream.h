@@ -0,0 +1,62 @@
+#ifndef ED_STREAM_H
+#define ED_STREAM_H
+
+// Models which don't fit in memory are cut into spatial chunks, which
+// are saved in a mesh cache with MESH_STREAM_EXTENSION appended to the
+// name of the model file. Every chunk is a model of its own, but its
+// geometry is only copied into memory while the chunk is near the
+// cameras, and the chunks in memory never take more than the budget of
+// the stream
+#define MESH_STREAM_EXTENSION ".edstream"
+
+enum Stream_Chunk_State {
+  Stream_Chunk_Unloaded = 0,
+  Stream_Chunk_Loading,
+  Stream_Chunk_Loaded,  // copied by a job, not used by the model yet
+  Stream_Chunk_Resident,
+};
+
+struct Stream_Chunk {
+  Mesh_Cache_Model cached;
+  int model_index;  // models can be reallocated
+  char *data;       // from cached.data_start to cached.data_end
+  i32 volatile state;
+
+  // Set on every update
+  bool visible;
+  bool wanted;
+  r32 distance;
+};
+
+// What a camera sees
+struct Stream_View {
+  m4x4 clip_transform;
+  v3 position;
+};
+
+struct Mesh_Stream {
+  static const u64 kDefaultBudget = MAX_INTERNAL_MEMORY_SIZE;
+  static const int kMaxLoadsInFlight = 4;
+  static const int kMaxChunkTriangles = 64 * 1024;
+
+  char filename[1024];
+  Mapped_File file;  // chunks are copied out of it
+  Stream_Chunk *chunks;
+  Stream_Chunk **order;  // by priority
+  int num_chunks;
+  u64 budget;
+  u64 resident_size;  // of the chunks which are loading or loaded
+  Job_Group loads;
+  int num_loading;      // as of the last update
+  bool has_new_chunks;  // since the renders were last restarted
+
+  bool open(Mapped_File *, Model **, Texture_Cache *);
+  void update(Program_State *, Stream_View *, int);
+  void destroy(Job_System *);
+};
+
+bool build_mesh_stream(char *, char *, Mapped_File *, Texture_Cache *,
+                       Job_System *);
+void update_mesh_streams(Program_State *);
+
+#endif  // ED_STREAM_H
@@ -0,0 +1,325 @@
+// Images are loaded as RGBA bytes, the framebuffer wants BGRA
+inline u32 swizzle_to_framebuffer(u32 rgba) {
+  return (rgba & 0xFF00FF00) | (rgba & 0xFF) << 16 | (rgba >> 16 & 0xFF);
+}
+
+// Rounded average of 4 texels, two channels at a time
+inline u32 average_texels(u32 a, u32 b, u32 c, u32 d) {
+  u32 mask = 0x00FF00FF;
+  u32 rb = (a & mask) + (b & mask) + (c & mask) + (d & mask) + 0x00020002;
+  u32 ag = (a >> 8 & mask) + (b >> 8 & mask) + (c >> 8 & mask) +
+           (d >> 8 & mask) + 0x00020002;
+  return (rb >> 2 & mask) | (ag << 6 & ~mask);
+}
+
+void Texture::init(Image *image) {
+  this->width = image->width;
+  this->height = image->height;
+  this->num_levels = 1;
+  int size = max(this->width, this->height);
+  while (this->num_levels < kMaxLevels &&
+         (size >> (this->num_levels - 1)) > 1) {
+    this->num_levels++;
+  }
+
+  u32 num_texels = 0;
+  for (int i = 0; i < this->num_levels; ++i) {
+    int level_width = max(this->width >> i, 1);
+    int level_height = max(this->height >> i, 1);
+    int tiles_x = (level_width + kTileSize - 1) >> kTileShift;
+    int tiles_y = (level_height + kTileSize - 1) >> kTileShift;
+    this->level_offsets[i] = num_texels;
+    num_texels += tiles_x * tiles_y * kTileSize * kTileSize;
+    this->level_scale_x[i] = (r32)level_width / this->width;
+    this->level_scale_y[i] = (r32)level_height / this->height;
+    this->level_max_x[i] = (r32)(level_width - 1);
+    this->level_max_y[i] = (r32)(level_height - 1);
+    this->level_tiles_x[i] = (r32)tiles_x;
+  }
+  this->texels = (u32 *)malloc(num_texels * sizeof(u32));
+
+  // Every level is box filtered from the previous one in place, which
+  // only overwrites the texels that have already been read
+  u32 *level = (u32 *)malloc(this->width * this->height * sizeof(u32));
+  for (int i = 0; i < this->width * this->height; ++i) {
+    level[i] = swizzle_to_framebuffer(image->data[i]);
+  }
+  int level_width = this->width;
+  int level_height = this->height;
+  for (int l = 0; l < this->num_levels; ++l) {
+    if (l > 0) {
+      int next_width = max(level_width / 2, 1);
+      int next_height = max(level_height / 2, 1);
+      for (int y = 0; y < next_height; ++y) {
+        u32 *row0 = level + min(2 * y, level_height - 1) * level_width;
+        u32 *row1 = level + min(2 * y + 1, level_height - 1) * level_width;
+        for (int x = 0; x < next_width; ++x) {
+          int x0 = min(2 * x, level_width - 1);
+          int x1 = min(2 * x + 1, level_width - 1);
+          level[y * next_width + x] =
+              average_texels(row0[x0], row0[x1], row1[x0], row1[x1]);
+        }
+      }
+      level_width = next_width;
+      level_height = next_height;
+    }
+
+    // The tiles on the right and bottom edges are padded with the
+    // edge texels
+    u32 *tiled = this->texels + this->level_offsets[l];
+    int tiles_x = (int)this->level_tiles_x[l];
+    int tiles_y = (level_height + kTileSize - 1) >> kTileShift;
+    for (int tile_y = 0; tile_y < tiles_y; ++tile_y) {
+      for (int tile_x = 0; tile_x < tiles_x; ++tile_x) {
+        for (int j = 0; j < kTileSize; ++j) {
+          int y = min(tile_y * kTileSize + j, level_height - 1);
+          for (int i = 0; i < kTileSize; ++i) {
+            int x = min(tile_x * kTileSize + i, level_width - 1);
+            *tiled++ = level[y * level_width + x];
+          }
+        }
+      }
+    }
+  }
+  free(level);
+}
+
+void Texture::destroy() {
+  free(this->texels);
+  this->texels = NULL;
+}
+
+Texture *Texture_Cache::request(char *path) {
+  for (int i = 0; i < sb_count(this->textures); ++i) {
+    if (strcmp(this->textures[i]->path, path) == 0) return this->textures[i];
+  }
+  Texture *texture = (Texture *)calloc(1, sizeof(*texture));
+  texture->path = (char *)malloc(strlen(path) + 1);
+  strcpy(texture->path, path);
+  sb_push(this->textures, texture);
+  return texture;
+}
+
+// A texture which can't be read stays empty, and its models untextured
+void load_texture_job(void *data, int) {
+  Texture *texture = *(Texture **)data;
+  Image image = {};
+  image.data = (u32 *)stbi_load(texture->path, &image.width, &image.height,
+                                &image.bytes_per_pixel, 4);
+  if (image.data == NULL) {
+    printf("Can't read texture file %s\n", texture->path);
+    return;
+  }
+  if (image.bytes_per_pixel < 3 || image.bytes_per_pixel > 4) {
+    printf("Image format not supported: %s\n", texture->path);
+  } else {
+    texture->init(&image);
+  }
+  stbi_image_free(image.data);
+}
+
+void Texture_Cache::load_requested(Job_System *jobs, Job_Group *group) {
+  for (int i = this->num_loaded; i < sb_count(this->textures); ++i) {
+    jobs->add(load_texture_job, &this->textures[i], sizeof(Texture *), group);
+  }
+  this->num_loaded = sb_count(this->textures);
+}
+
+void Texture_Cache::destroy() {
+  for (int i = 0; i < sb_count(this->textures); ++i) {
+    this->textures[i]->destroy();
+    free(this->textures[i]->path);
+    free(this->textures[i]);
+  }
+  sb_free(this->textures);
+  this->num_loaded = 0;
+}
+
+// Bilinear weights are in 1/256 steps
+const r32 kTexelWeightStep = 1.0f / 256.0f;
+
+// Lerps between the texels of every lane with weights from 0 to 256,
+// in fixed point in the 16-bit halves of the lanes
+inline v4i lerp_texels(const v4i &a, const v4i &b, const v4i &weight) {
+  v4i mask = v4i(0x00FF00FF);
+  v4i weight_b = weight | shiftl<16>(weight);
+  v4i weight_a = v4i(0x01000100) - weight_b;
+  v4i rb = mullo16(a & mask, weight_a) + mullo16(b & mask, weight_b);
+  v4i ag = mullo16(shiftr<8>(a) & mask, weight_a) +
+           mullo16(shiftr<8>(b) & mask, weight_b);
+  return (shiftr<8>(rb) & mask) | andnot(mask, ag);
+}
+
+// Scales the color channels by intensities from 0 to 1 and keeps the
+// alpha
+inline v4i modulate(const v4i &color, const v4 &intensity) {
+  v4i weight = ftoi(intensity * v4(256.0f));
+  v4i mask = v4i(0x00FF00FF);
+  v4i rb = shiftr<8>(mullo16(color & mask, weight | shiftl<16>(weight)));
+  v4i g = mullo16(shiftr<8>(color) & v4i(0xFF), weight);
+  return (color & v4i(0xFF000000)) | (rb & mask) | (g & v4i(0xFF00));
+}
+
+// Index of a texel in the tiled layout is the sum of a part which only
+// depends on the column and one which depends on the row
+inline v4i tiled_column(const v4 &x) {
+  v4i column = ftoi(x);
+  return shiftl<2 * Texture::kTileShift>(shiftr<Texture::kTileShift>(column)) +
+         (column & v4i(Texture::kTileSize - 1));
+}
+
+inline v4i tiled_row(const v4 &y, const v4 &tiles_x) {
+  v4i row = ftoi(y);
+  v4i tile_row = ftoi(itof(shiftr<Texture::kTileShift>(row)) * tiles_x);
+  return shiftl<2 * Texture::kTileShift>(tile_row) +
+         shiftl<Texture::kTileShift>(row & v4i(Texture::kTileSize - 1));
+}
+
+// Wraps coordinates into [0, size) of a level
+inline v4 wrap_texels(const v4 &x, r32 size) {
+  v4 q = x * v4(1.0f / size);
+  v4 whole = itof(ftoi(q));
+  whole = whole - v4_and(cmplt(q, whole), v4(1.0f));  // floor
+  return x - whole * v4(size);
+}
+
+// Bilinear lookup in one level. The texels past the last column and row
+// are the first ones again. Wrapped coordinates are still clamped, so
+// that NaNs and rounding end up at the edges
+inline v4i sample_level(Texture *texture, const v4 &s, const v4 &t,
+                        int level) {
+  r32 width = texture->level_max_x[level] + 1.0f;
+  r32 height = texture->level_max_y[level] + 1.0f;
+  v4 max_x = v4(width - kTexelWeightStep);
+  v4 max_y = v4(height - kTexelWeightStep);
+  v4 x = wrap_texels(s * v4(texture->level_scale_x[level]) - v4(0.5f), width);
+  v4 y = wrap_texels(t * v4(texture->level_scale_y[level]) - v4(0.5f), height);
+  x = vmin(vmax(x, v4::zero()), max_x);
+  y = vmin(vmax(y, v4::zero()), max_y);
+  v4 x0 = itof(ftoi(x));
+  v4 y0 = itof(ftoi(y));
+  v4 x1 = x0 + v4(1.0f);
+  v4 y1 = y0 + v4(1.0f);
+  x1 = v4_and(cmplt(x1, v4(width)), x1);
+  y1 = v4_and(cmplt(y1, v4(height)), y1);
+  v4i weight_x = ftoi((x - x0) * v4(256.0f));
+  v4i weight_y = ftoi((y - y0) * v4(256.0f));
+
+  v4 tiles_x = v4(texture->level_tiles_x[level]);
+  u32 *texels = texture->texels + texture->level_offsets[level];
+  v4i column0 = tiled_column(x0);
+  v4i column1 = tiled_column(x1);
+  v4i row0 = tiled_row(y0, tiles_x);
+  v4i row1 = tiled_row(y1, tiles_x);
+  v4i top = lerp_texels(gather(texels, row0 + column0),
+                        gather(texels, row0 + column1), weight_x);
+  v4i bottom = lerp_texels(gather(texels, row1 + column0),
+                           gather(texels, row1 + column1), weight_x);
+  return lerp_texels(top, bottom, weight_y);
+}
+
+// Trilinear in the middle half between two levels, and bilinear in the
+// nearer level elsewhere, which saves half of the second lookups
+v4i Texture::sample(v4 s, v4 t, r32 lod) {
+  lod = min(max(lod, 0.0f), (r32)(this->num_levels - 1));  // also NaNs
+  int level = (int)lod;
+  r32 blend = 2.0f * (lod - level) - 0.5f;
+  if (blend >= 1.0f) {
+    level++;
+    blend = 0;
+  }
+  v4i result = sample_level(this, s, t, level);
+  if (blend > 0) {
+    v4i next = sample_level(this, s, t, level + 1);
+    result = lerp_texels(result, next, v4i((i32)(blend * 256.0f)));
+  }
+  return result;
+}
+
+// Same as above, 8 lanes at a time
+ED_AVX2 inline v8i lerp_texels(const v8i &a, const v8i &b,
+                               const v8i &weight) {
+  v8i mask = v8i(0x00FF00FF);
+  v8i weight_b = weight | shiftl<16>(weight);
+  v8i weight_a = v8i(0x01000100) - weight_b;
+  v8i rb = mullo16(a & mask, weight_a) + mullo16(b & mask, weight_b);
+  v8i ag = mullo16(shiftr<8>(a) & mask, weight_a) +
+           mullo16(shiftr<8>(b) & mask, weight_b);
+  return (shiftr<8>(rb) & mask) | andnot(mask, ag);
+}
+
+ED_AVX2 inline v8i modulate(const v8i &color, const v8 &intensity) {
+  v8i weight = ftoi(intensity * v8(256.0f));
+  v8i mask = v8i(0x00FF00FF);
+  v8i rb = shiftr<8>(mullo16(color & mask, weight | shiftl<16>(weight)));
+  v8i g = mullo16(shiftr<8>(color) & v8i(0xFF), weight);
+  return (color & v8i(0xFF000000)) | (rb & mask) | (g & v8i(0xFF00));
+}
+
+ED_AVX2 inline v8i tiled_column(const v8 &x) {
+  v8i column = ftoi(x);
+  return shiftl<2 * Texture::kTileShift>(shiftr<Texture::kTileShift>(column)) +
+         (column & v8i(Texture::kTileSize - 1));
+}
+
+ED_AVX2 inline v8i tiled_row(const v8 &y, const v8i &tiles_x) {
+  v8i row = ftoi(y);
+  v8i tile_row = shiftr<Texture::kTileShift>(row) * tiles_x;
+  return shiftl<2 * Texture::kTileShift>(tile_row) +
+         shiftl<Texture::kTileShift>(row & v8i(Texture::kTileSize - 1));
+}
+
+ED_AVX2 inline v8 wrap_texels(const v8 &x, r32 size) {
+  v8 q = x * v8(1.0f / size);
+  v8 whole = itof(ftoi(q));
+  whole = whole - v8_and(cmplt(q, whole), v8(1.0f));
+  return x - whole * v8(size);
+}
+
+ED_AVX2 inline v8i sample_level(Texture *texture, const v8 &s, const v8 &t,
+                                int level) {
+  r32 width = texture->level_max_x[level] + 1.0f;
+  r32 height = texture->level_max_y[level] + 1.0f;
+  v8 max_x = v8(width - kTexelWeightStep);
+  v8 max_y = v8(height - kTexelWeightStep);
+  v8 x = wrap_texels(s * v8(texture->level_scale_x[level]) - v8(0.5f), width);
+  v8 y = wrap_texels(t * v8(texture->level_scale_y[level]) - v8(0.5f), height);
+  x = vmin(vmax(x, v8::zero()), max_x);
+  y = vmin(vmax(y, v8::zero()), max_y);
+  v8 x0 = itof(ftoi(x));
+  v8 y0 = itof(ftoi(y));
+  v8 x1 = x0 + v8(1.0f);
+  v8 y1 = y0 + v8(1.0f);
+  x1 = v8_and(cmplt(x1, v8(width)), x1);
+  y1 = v8_and(cmplt(y1, v8(height)), y1);
+  v8i weight_x = ftoi((x - x0) * v8(256.0f));
+  v8i weight_y = ftoi((y - y0) * v8(256.0f));
+
+  v8i tiles_x = v8i((i32)texture->level_tiles_x[level]);
+  u32 *texels = texture->texels + texture->level_offsets[level];
+  v8i column0 = tiled_column(x0);
+  v8i column1 = tiled_column(x1);
+  v8i row0 = tiled_row(y0, tiles_x);
+  v8i row1 = tiled_row(y1, tiles_x);
+  v8i top = lerp_texels(gather(texels, row0 + column0),
+                        gather(texels, row0 + column1), weight_x);
+  v8i bottom = lerp_texels(gather(texels, row1 + column0),
+                           gather(texels, row1 + column1), weight_x);
+  return lerp_texels(top, bottom, weight_y);
+}
+
+ED_AVX2 v8i Texture::sample(const v8 &s, const v8 &t, r32 lod) {
+  lod = min(max(lod, 0.0f), (r32)(this->num_levels - 1));
+  int level = (int)lod;
+  r32 blend = 2.0f * (lod - level) - 0.5f;
+  if (blend >= 1.0f) {
+    level++;
+    blend = 0;
+  }
+  v8i result = sample_level(this, s, t, level);
+  if (blend > 0) {
+    v8i next = sample_level(this, s, t, level + 1);
+    result = lerp_texels(result, next, v8i((i32)(blend * 256.0f)));
+  }
+  return result;
+}
@@ -0,0 +1,55 @@
+#ifndef ED_TEXTURE_H
+#define ED_TEXTURE_H
+
+// A texture with a full chain of mip levels, each half the size of the
+// previous one. Texels of every level are stored in 4x4 tiles of 64
+// bytes, so that a bilinear lookup mostly stays in one cache line, and
+// are already in the order of the framebuffer (0xAARRGGBB).
+//
+// The samplers take coordinates in texels of the first level, with
+// (0, 0) in the top left corner, and the level of detail, which is the
+// log2 of the number of texels covered by a pixel. Like the 2x2 quads
+// of a GPU, all the lanes share one level of detail, which keeps the
+// level lookups scalar. Coordinates wrap around, so that textures repeat
+// as they do for the UVs past 0 and 1 which OBJ files often have
+struct Texture {
+  static const int kMaxLevels = 16;
+  static const int kTileShift = 2;
+  static const int kTileSize = 1 << kTileShift;
+
+  u32 *texels;  // all the levels, NULL if there's no texture
+  char *path;   // of the image, the key in the texture cache
+  int width;
+  int height;
+  int num_levels;
+
+  // Per level. Floats are exact for the sizes of the levels
+  u32 level_offsets[kMaxLevels];
+  r32 level_scale_x[kMaxLevels];  // size relative to the first level
+  r32 level_scale_y[kMaxLevels];
+  r32 level_max_x[kMaxLevels];  // coordinates of the last texel
+  r32 level_max_y[kMaxLevels];
+  r32 level_tiles_x[kMaxLevels];  // tiles in a row
+
+  void init(Image *);
+  v4i sample(v4, v4, r32);
+  ED_AVX2 v8i sample(const v8 &, const v8 &, r32);
+  void destroy();
+};
+
+struct Job_System;
+struct Job_Group;
+
+// Models which use the same image share one texture, so every image is
+// only read once. Requested textures have no texels until they are
+// loaded, which decodes all the new ones in parallel
+struct Texture_Cache {
+  Texture **textures;
+  int num_loaded;  // the ones after it have only been requested
+
+  Texture *request(char *);
+  void load_requested(Job_System *, Job_Group *);
+  void destroy();
+};
+
+#endif  // ED_TEXTURE_H
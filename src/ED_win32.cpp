@@ -6,14 +6,26 @@
 #include "debug/ED_debug.h"
 #include "ED_math.h"
 #include "ED_core.h"
+#include "ED_texture.h"
 #include "ED_model.h"
+#include "ED_bvh.h"
+#include "ED_mesh_cache.h"
+#include "ED_jobs.h"
+#include "ED_stream.h"
+#include "ED_raster.h"
 #include "editors/editors.h"
 #include "ui/ED_ui.h"
 
 #include "ED_core.cpp"
 #include "ED_math.cpp"
+#include "ED_texture.cpp"
 #include "ED_model.cpp"
+#include "ED_bvh.cpp"
+#include "ED_mesh_cache.cpp"
+#include "ED_jobs.cpp"
+#include "ED_stream.cpp"
 #include "ED_drawing.cpp"
+#include "ED_raster.cpp"
 #include "editors/3dview.cpp"
 #include "editors/raytrace.cpp"
 #include "ui/ED_ui.cpp"
@@ -56,24 +68,62 @@ struct Thread_Info {
   HANDLE thread_handle;
 };
 
-struct Win32_Raytrace_Work_Queue : Raytrace_Work_Queue {
+struct Win32_Job_System : Job_System {
   HANDLE semaphore;
 
-  virtual void add_entry(Raytrace_Work_Entry);
+  virtual void wake_up_workers(int);
+  virtual void wait_for_jobs();
 };
 
-void Win32_Raytrace_Work_Queue::add_entry(Raytrace_Work_Entry entry) {
-  u32 new_next_entry_to_add =
-      (this->next_entry_to_add + 1) % COUNT_OF(this->entries);
-  assert(new_next_entry_to_add != this->next_entry_to_do);
-  Raytrace_Work_Entry *entry_to_add = this->entries + this->next_entry_to_add;
-  *entry_to_add = entry;
-  _WriteBarrier();
-  this->next_entry_to_add = new_next_entry_to_add;
-  ReleaseSemaphore(this->semaphore, 1, 0);
+void Win32_Job_System::wake_up_workers(int count) {
+  // Fails when the count is already at max, which is fine
+  ReleaseSemaphore(this->semaphore, count, 0);
 }
 
-global Win32_Raytrace_Work_Queue g_raytrace_queue;
+void Win32_Job_System::wait_for_jobs() {
+  WaitForSingleObjectEx(this->semaphore, INFINITE, FALSE);
+}
+
+bool Mapped_File::map(char *filename) {
+  this->data = NULL;
+  this->size = 0;
+  this->modified_time = 0;
+  HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+                            OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (file == INVALID_HANDLE_VALUE) return false;
+
+  bool result = false;
+  LARGE_INTEGER size;
+  FILETIME write_time;
+  if (GetFileSizeEx(file, &size) &&
+      GetFileTime(file, NULL, NULL, &write_time)) {
+    this->size = (size_t)size.QuadPart;
+    this->modified_time =
+        (u64)write_time.dwHighDateTime << 32 | write_time.dwLowDateTime;
+    if (this->size == 0) {
+      result = true;  // empty files can't be mapped
+    } else {
+      HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, 0);
+      if (mapping != NULL) {
+        // The view keeps the mapping alive
+        this->data = (char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(mapping);
+        result = (this->data != NULL);
+      }
+    }
+  }
+  CloseHandle(file);
+  return result;
+}
+
+void Mapped_File::unmap() {
+  if (this->data != NULL) UnmapViewOfFile(this->data);
+  this->data = NULL;
+  this->size = 0;
+}
+
+global Win32_Job_System g_job_system;
+global Thread_Info *g_win32_threads;
 global LARGE_INTEGER gPerformanceFrequency;
 global GLuint gTextureHandle;
 
@@ -196,38 +246,23 @@ inline r32 Win32GetMillisecondsElapsed(LARGE_INTEGER Start, LARGE_INTEGER End) {
   return Result;
 }
 
-// TODO: completion count?
-DWORD WINAPI RaytraceWorkerThread(LPVOID lpParam) {
-  Thread_Info *info = (Thread_Info *)lpParam;
-
-  Win32_Raytrace_Work_Queue *queue = &g_raytrace_queue;
-
-  for (;;) {
-    u32 original_next_entry_to_do = queue->next_entry_to_do;
-    u32 new_next_entry_to_do =
-        (original_next_entry_to_do + 1) % COUNT_OF(queue->entries);
-
-    if (original_next_entry_to_do != queue->next_entry_to_add) {
-      // There's probably work to do
-      u32 index = InterlockedCompareExchange(
-          (LONG volatile *)&queue->next_entry_to_do, new_next_entry_to_do,
-          original_next_entry_to_do);
-      if (index == original_next_entry_to_do) {
-        // No other thread has beaten us to it, do the work
-        Raytrace_Work_Entry entry = queue->entries[index];
-        queue->entries_in_progress[info->thread_num] = index;
-        // The line above may cause a machine clear but that's probably OK?
-        entry.editor->trace_tile(entry.models, entry.start, entry.end);
-        printf("Thread %d did work entry %d\n", info->thread_num, index);
-        queue->entries_in_progress[info->thread_num] = -1;
-      }
-    } else {
-      // Sleep
-      printf("Thread %d went to sleep\n", info->thread_num);
-      WaitForSingleObjectEx(queue->semaphore, INFINITE, FALSE);
-      printf("Thread %d has woken up\n", info->thread_num);
-    }
+int Win32GetNumCores() {
+  DWORD_PTR process_mask, system_mask;
+  if (GetProcessAffinityMask(GetCurrentProcess(), &process_mask,
+                             &system_mask)) {
+    int result = 0;
+    for (; process_mask; process_mask &= process_mask - 1) result++;
+    return result;
   }
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return (int)info.dwNumberOfProcessors;
+}
+
+DWORD WINAPI WorkerThread(LPVOID lpParam) {
+  Thread_Info *info = (Thread_Info *)lpParam;
+  g_job_system.worker_loop(info->thread_num);
+  return 0;
 }
 
 int CALLBACK WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance,
@@ -237,11 +272,42 @@ int CALLBACK WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance,
   g_program_memory.free_memory = g_program_memory.start;
   // TODO: add checks for overflow when allocating
 
+  // Create worker threads before loading, which uses them
+  {
+    g_num_worker_threads =
+        choose_num_worker_threads(__argc, __argv, Win32GetNumCores());
+    g_win32_threads = (Thread_Info *)malloc(g_num_worker_threads *
+                                            sizeof(*g_win32_threads));
+
+    // Init job system, the main thread gets index 0
+    g_job_system.init(g_num_worker_threads);
+    u32 initial_count = 0;
+    g_job_system.semaphore =
+        CreateSemaphoreEx(0, initial_count, g_num_worker_threads, 0, 0,
+                          SEMAPHORE_ALL_ACCESS);
+
+    for (int i = 0; i < g_num_worker_threads; i++) {
+      g_win32_threads[i].thread_num = i + 1;
+      HANDLE thread_handle = CreateThread(
+          0,                    // LPSECURITY_ATTRIBUTES lpThreadAttributes,
+          0,                    // SIZE_T dwStackSize,
+          WorkerThread,         // LPTHREAD_START_ROUTINE lpStartAddress,
+          &g_win32_threads[i],  // LPVOID lpParameter,
+          0,                    // DWORD dwCreationFlags,
+          NULL                  // LPDWORD lpThreadId
+          );
+      g_win32_threads[i].thread_handle = thread_handle;
+      if (thread_handle == NULL) {
+        printf("CreateThread error: %d\n", GetLastError());
+        exit(1);
+      }
+    }
+  }
+
   // Main program state
   Program_State *state =
       (Program_State *)g_program_memory.allocate(sizeof(Program_State));
-  state->init(&g_program_memory, &g_pixel_buffer,
-              (Raytrace_Work_Queue *)&g_raytrace_queue);
+  state->init(&g_program_memory, &g_pixel_buffer, &g_job_system);
 
   // Create window class
   WNDCLASS WindowClass = {};
@@ -352,36 +418,6 @@ int CALLBACK WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance,
 
   LARGE_INTEGER last_timestamp = Win32GetWallClock();
 
-  // Create worker threads
-  {
-    const int kNumThreads = 4;
-
-    // Init work queue
-    g_raytrace_queue.next_entry_to_add = 0;
-    g_raytrace_queue.next_entry_to_do = 0;
-    u32 initial_num_threads = 0;
-    g_raytrace_queue.semaphore = CreateSemaphoreEx(
-        0, initial_num_threads, kNumThreads, 0, 0, SEMAPHORE_ALL_ACCESS);
-
-    Thread_Info threads[kNumThreads];
-    for (int i = 0; i < kNumThreads; i++) {
-      threads[i].thread_num = i + 1;
-      HANDLE thread_handle = CreateThread(
-          0,                     // LPSECURITY_ATTRIBUTES lpThreadAttributes,
-          0,                     // SIZE_T dwStackSize,
-          RaytraceWorkerThread,  // LPTHREAD_START_ROUTINE lpStartAddress,
-          &threads[i],           // LPVOID lpParameter,
-          0,                     // DWORD dwCreationFlags,
-          NULL                   // LPDWORD lpThreadId
-          );
-      threads[i].thread_handle = thread_handle;
-      if (thread_handle == NULL) {
-        printf("CreateThread error: %d\n", GetLastError());
-        exit(1);
-      }
-    }
-  }
-
   // Event loop
   while (g_running) {
     // Process messages
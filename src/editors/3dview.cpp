@@ -9,21 +9,12 @@ Model *select_model(Model *models, Ray ray) {
     if (!model->display) continue;
     if (!ray.hits_aabb(model->aabb)) continue;
 
-    // Put model in the scene
-    m4x4 ModelTransform = model->get_transform_matrix();
-
-    for (int tr = 0; tr < sb_count(model->triangles); ++tr) {
-      Triangle triangle = model->triangles[tr];
-      v3 vertices[3];
-      for (int i = 0; i < 3; ++i) {
-        vertices[i] =
-            ModelTransform * model->vertices[triangle.vertices[i].index];
-      }
-      Triangle_Hit hit = ray.hits_triangle(vertices);
-      if (hit.at > 0 && hit.at < min_hit) {
-        min_hit = hit.at;
-        result = model;
-      }
+    Triangle_Hit hit;
+    hit.at = min_hit;
+    int triangle_id;
+    if (model->hits(ray, &hit, &triangle_id)) {
+      min_hit = hit.at;
+      result = model;
     }
   }
 
@@ -43,14 +34,26 @@ void Editor_3DView::update(Program_State *state, User_Input *input) {
     v2i mouse_position = this->area->get_rect().projected(input->mouse);
     Ray ray = this->camera.get_ray_through_pixel(mouse_position);
 
-    if (input->key_went_down('A')) {
+    // Streamed geometry is freed and reloaded behind the model's back,
+    // so a copy of its pointers would dangle
+    if (input->key_went_down('A') && !state->models[0].is_streamed) {
       // @TMP
+      // The copy shares vertices and the BVH with the original
       Model model = state->models[0];
+      model.is_instance = true;
       model.position = ui->cursor;
       model.direction = (this->camera.position - model.position).normalized();
       model.transform_calculated = false;
       sb_push(state->models, model);
     }
+    if (input->key_went_down('B') && state->selected_model != NULL) {
+      // Open meshes need their back faces
+      Model *model = state->selected_model;
+      model->cull_backfaces = !model->cull_backfaces;
+    }
+    if (input->key_went_down('T')) {
+      this->textured = !this->textured;
+    }
     if (input->key_went_down('5')) {
       this->camera.ortho_projection = !this->camera.ortho_projection;
     } else if (input->key_went_down('1') || input->key_went_down('3') ||
@@ -186,10 +189,16 @@ void Editor_3DView::draw(Pixel_Buffer *buffer, r32 *z_buffer,
 
   m4x4 WorldTransform = ViewportTransform * ClipSpaceTransform;
 
-  // #pragma omp parallel for num_threads(2)
+  // Triangles of the visible models are drawn all at once by tiles
+  Rasterizer *rasterizer = state->rasterizer;
+  rasterizer->begin(this->area, z_buffer, ClipSpaceTransform,
+                    -this->camera.direction, this->textured);
+  bool selected_model_visible = false;
+
   for (int m = 0; m < sb_count(state->models); ++m) {
     Model *model = state->models + m;
     if (!model->display) continue;
+    if (model->vertices == NULL) continue;  // streamed out
 
     if (model->old_position != model->position ||
         model->old_direction != model->direction) {
@@ -199,7 +208,8 @@ void Editor_3DView::draw(Pixel_Buffer *buffer, r32 *z_buffer,
       model->update_aabb(true);  // transformed model aabb
     }
 
-    // Basic frustum culling
+    // Basic frustum culling: skip the model if all corners of its box
+    // are outside the same side of the view volume
     // (the vertices are already in the scene space)
     {
       v3 min = model->aabb.min;
@@ -214,76 +224,52 @@ void Editor_3DView::draw(Pixel_Buffer *buffer, r32 *z_buffer,
           {min.x, max.y, max.z},
           {max.x, max.y, max.z},
       };
-
-      // TODO: simd?
-      bool all_outside_clipping_volume = true;
+      u8 clip_flags[8];
+      Matrix::transform_points(ClipSpaceTransform, verts, 8, verts,
+                               clip_flags);
+      u8 outside_all = 0xFF;
       for (int i = 0; i < 8; ++i) {
-        v3 v = ClipSpaceTransform * verts[i];
-        bool vertex_inside = (-1.0f <= v.x && v.x <= 1.0f) &&
-                             (-1.0f <= v.y && v.y <= 1.0f) &&
-                             (-1.0f <= v.z && v.z <= 1.0f);
-        if (vertex_inside) {
-          all_outside_clipping_volume = false;
-          break;
-        }
+        outside_all &= clip_flags[i];
       }
-      if (all_outside_clipping_volume) {
+      if (outside_all) {
         continue;  // skip the model
       }
     }
 
     // Put model in the scene
-    m4x4 ModelTransform = model->get_transform_matrix();
-
-    v3 light_dir = -this->camera.direction;
-    bool outline = (model == state->selected_model);
-
-    for (int tr = 0; tr < sb_count(model->triangles); ++tr) {
-      Triangle triangle = model->triangles[tr];
-      v3 scene_verts[3];
-      v3 screen_verts[3];
-      // v2 texture_verts[3];
-      v3 vns[3];
-
-      for (int i = 0; i < 3; ++i) {
-        scene_verts[i] =
-            ModelTransform * model->vertices[triangle.vertices[i].index];
-
-        screen_verts[i] = WorldTransform * scene_verts[i];
-        vns[i] = model->vns[triangle.vertices[i].vn_index];
-        vns[i] = V3(ModelTransform * V4_v(vns[i])).normalized();
-      }
-
-      triangle_rasterize_simd(area, screen_verts, vns, z_buffer, light_dir,
-                              outline);
-    }
-
+    rasterizer->add_model(model);
     if (model == state->selected_model) {
-      v3 min = model->aabb.min;
-      v3 max = model->aabb.max;
-      // Draw the direction vector
-      draw_line(area, WorldTransform * model->position,
-                WorldTransform * (model->position + model->direction * 0.3f),
-                0x00FF0000, z_buffer);
-
-      // Draw AABBoxes
-      v3 verts[] = {
-          {min.x, min.y, min.z},
-          {min.x, min.y, max.z},
-          {max.x, min.y, max.z},
-          {max.x, min.y, min.z},
-          {max.x, max.y, min.z},
-          {min.x, max.y, min.z},
-          {min.x, max.y, max.z},
-          {max.x, max.y, max.z},
-      };
-      int lines[] = {0, 1, 1, 2, 2, 3, 3, 0, 5, 6, 6, 7,
-                     7, 4, 4, 5, 0, 5, 3, 4, 1, 6, 2, 7};
-      // assert(COUNT_OF(lines) % 2 == 0);
-      for (size_t i = 0; i < COUNT_OF(lines); i += 2) {
-        draw_line(area, WorldTransform * verts[lines[i]],
-                  WorldTransform * verts[lines[i + 1]], 0x00FFAA40, z_buffer);
-      }
+      selected_model_visible = true;
+    }
+  }
+  rasterizer->draw(state->jobs);
+
+  if (selected_model_visible) {
+    Model *model = state->selected_model;
+    v3 min = model->aabb.min;
+    v3 max = model->aabb.max;
+    // Draw the direction vector
+    draw_line(area, WorldTransform * model->position,
+              WorldTransform * (model->position + model->direction * 0.3f),
+              0x00FF0000, z_buffer);
+
+    // Draw AABBoxes
+    v3 verts[] = {
+        {min.x, min.y, min.z},
+        {min.x, min.y, max.z},
+        {max.x, min.y, max.z},
+        {max.x, min.y, min.z},
+        {max.x, max.y, min.z},
+        {min.x, max.y, min.z},
+        {min.x, max.y, max.z},
+        {max.x, max.y, max.z},
+    };
+    int lines[] = {0, 1, 1, 2, 2, 3, 3, 0, 5, 6, 6, 7,
+                   7, 4, 4, 5, 0, 5, 3, 4, 1, 6, 2, 7};
+    // assert(COUNT_OF(lines) % 2 == 0);
+    for (size_t i = 0; i < COUNT_OF(lines); i += 2) {
+      draw_line(area, WorldTransform * verts[lines[i]],
+                WorldTransform * verts[lines[i + 1]], 0x00FFAA40, z_buffer);
     }
   }
 
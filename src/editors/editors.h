@@ -31,34 +31,51 @@ char *Editor_Names[Area_Editor_Type__COUNT] = {
 struct Editor_3DView : Area_Editor {
   Camera camera;
   Editor_3DView_Mode mode;
+  bool textured = true;
 
   void update(Program_State *, User_Input *);
   void draw(Pixel_Buffer *, r32 *, Program_State *);
 };
 
+struct Raytrace_Tile {
+  v2i start;
+  v2i end;
+  bool volatile in_progress;
+};
+
 struct Editor_Raytrace : Area_Editor {
   Pixel_Buffer backbuffer;
+  Instance_BVH scene;  // rebuilt for every render
+  Job_Group render_jobs;
+  Raytrace_Tile *tiles_in_progress;  // by thread index
+  Camera render_camera;  // copied when a render starts
+
+  // Incremented for every render, tiles of older renders stop early
+  i32 volatile generation;
+
+  // In progressive mode the first pass traces one pixel per 8x8 block,
+  // and each next pass halves the block size
+  static const int kFirstPassStep = 8;
+  bool progressive = true;
+  int pass_step;
 
   void update(User_Input *);
   void draw(Pixel_Buffer *, Program_State *);
-  void trace_tile(Model *, v2i, v2i);
+  void start_pass(Program_State *);
+  void trace_tile(Model *, v2i, v2i, int, bool, i32);
+  void stop_render(Job_System *);
+  void destroy(Job_System *);
 };
 
-struct Raytrace_Work_Entry {
+struct Raytrace_Tile_Job {
   Editor_Raytrace *editor;
   Model *models;
   v2i start;
   v2i end;
-};
-
-struct Raytrace_Work_Queue {
-  u32 volatile next_entry_to_do;
-  u32 volatile next_entry_to_add;
-
-  Raytrace_Work_Entry entries[256];
-  int volatile entries_in_progress[g_kNumThreads];
-
-  virtual void add_entry(Raytrace_Work_Entry) = 0;
+  int step;
+  bool refining;
+  i32 generation;
+  int cost;  // estimated, only used for ordering
 };
 
 #endif  // __ED_EDITORS_H__
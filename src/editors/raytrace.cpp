@@ -5,15 +5,78 @@ void Editor_Raytrace::update(User_Input *input) {
       this->area->editor_type = Area_Editor_Type_3DView;
       this->area->type_select.option_selected = this->area->editor_type;
     }
+    if (input->key_went_down('P')) {
+      this->progressive = !this->progressive;
+      this->needs_redraw = true;
+    }
+  }
+}
+
+void raytrace_tile_job(void *data, int thread_index) {
+  Raytrace_Tile_Job *job = (Raytrace_Tile_Job *)data;
+  if (job->generation != job->editor->generation) return;
+  Raytrace_Tile *tile = job->editor->tiles_in_progress + thread_index;
+  tile->start = job->start;
+  tile->end = job->end;
+  tile->in_progress = true;
+  job->editor->trace_tile(job->models, job->start, job->end, job->step,
+                          job->refining, job->generation);
+  tile->in_progress = false;
+}
+
+// Projects a world space box onto the pixels traced by trace_tile.
+// Returns false if the box is not entirely in front of the camera
+bool project_aabb(Camera *camera, AABBox aabb, v2 *min_pixel,
+                  v2 *max_pixel) {
+  m4x4 WorldToCamera = camera->transform_to_entity_space();
+  v2 pixel_size = V2(2 * camera->right / camera->viewport.x,
+                     2 * camera->top / camera->viewport.y);
+  v2 result_min = V2(INFINITY, INFINITY);
+  v2 result_max = V2(-INFINITY, -INFINITY);
+  for (int corner = 0; corner < 8; ++corner) {
+    v3 point;
+    point.x = (corner & 1) ? aabb.max.x : aabb.min.x;
+    point.y = (corner & 2) ? aabb.max.y : aabb.min.y;
+    point.z = (corner & 4) ? aabb.max.z : aabb.min.z;
+    point = WorldToCamera * point;
+    if (point.z >= camera->near) return false;  // the camera looks at -z
+    v2 pixel;
+    pixel.x = (point.x * camera->near / point.z + camera->right) /
+                  pixel_size.x - 0.5f;
+    pixel.y = (point.y * camera->near / point.z + camera->top) /
+                  pixel_size.y - 0.5f;
+    result_min.x = min(result_min.x, pixel.x);
+    result_min.y = min(result_min.y, pixel.y);
+    result_max.x = max(result_max.x, pixel.x);
+    result_max.y = max(result_max.y, pixel.y);
   }
+  *min_pixel = result_min;
+  *max_pixel = result_max;
+  return true;
+}
+
+int compare_tile_jobs_by_cost(const void *a, const void *b) {
+  return ((Raytrace_Tile_Job *)b)->cost - ((Raytrace_Tile_Job *)a)->cost;
 }
 
 void Editor_Raytrace::draw(Pixel_Buffer *buffer, Program_State *state) {
   int area_width = this->area->get_width();
   int area_height = this->area->get_height();
 
+  // The render has to restart if the area has been resized
+  if (area_width != this->backbuffer.width ||
+      area_height != this->backbuffer.height) {
+    this->needs_redraw = true;
+  }
+
   if (!this->needs_redraw) {
     TIMED_BLOCK();
+    // Refine once the previous pass is finished
+    if (this->pass_step > 1 && this->render_jobs.is_done()) {
+      this->pass_step /= 2;
+      this->start_pass(state);
+    }
+
     // Blit the contents of the back buffer
     // TODO: simd?
     v2i start, end;
@@ -40,13 +103,11 @@ void Editor_Raytrace::draw(Pixel_Buffer *buffer, Program_State *state) {
                      (this->backbuffer.height - area_height) / 2);
 
     // Draw the markers of the areas being currently drawn
-    for (int i = 0; i < g_kNumThreads; ++i) {
-      int entry_in_progress = state->raytrace_queue->entries_in_progress[i];
-      if (entry_in_progress >= 0) {
-        Raytrace_Work_Entry *entry =
-            state->raytrace_queue->entries + entry_in_progress;
-        v2i lb = entry->start - offset;
-        v2i rt = entry->end - offset;
+    for (int i = 0; i < state->jobs->num_threads; ++i) {
+      Raytrace_Tile *tile = this->tiles_in_progress + i;
+      if (tile->in_progress) {
+        v2i lb = tile->start - offset;
+        v2i rt = tile->end - offset;
         v2i lt = V2i(lb.x, rt.y);
         v2i rb = V2i(rt.x, lb.y);
         const int kLen = 10;  // corner line length
@@ -68,6 +129,11 @@ void Editor_Raytrace::draw(Pixel_Buffer *buffer, Program_State *state) {
   // Draw
   this->needs_redraw = false;
 
+  // Stop the previous render before changing anything its tiles use
+  this->generation++;
+  state->jobs->cancel(&this->render_jobs);
+  this->render_camera = this->area->editor_3dview.camera;
+
   // Always update the boundaries when drawing
   this->backbuffer.width = area_width;
   this->backbuffer.height = area_height;
@@ -87,121 +153,279 @@ void Editor_Raytrace::draw(Pixel_Buffer *buffer, Program_State *state) {
     this->backbuffer.memory = realloc(this->backbuffer.memory, bb_size);
   }
 
+  if (this->tiles_in_progress == NULL) {
+    int num_threads = state->jobs->num_threads;
+    this->tiles_in_progress =
+        (Raytrace_Tile *)calloc(num_threads, sizeof(Raytrace_Tile));
+  }
+
   // Clear (maybe temporary)
   memset(this->backbuffer.memory, EDITOR_BACKGROUND_COLOR, bb_size);
 
-  const int kTileCount = 4;  // one side
-  v2i tile_size = {area_width / kTileCount, area_height / kTileCount};
-  for (int y = 0; y < kTileCount; ++y) {
-    for (int x = 0; x < kTileCount; ++x) {
-      v2i start = {x * tile_size.x, y * tile_size.y};
-      v2i end = start + tile_size;
-      Raytrace_Work_Entry entry;
-      entry.editor = this;
-      entry.models = state->models;
-      entry.start = start;
-      entry.end = end;
-      state->raytrace_queue->add_entry(entry);
+  // Instances are cheap to rebuild, while model BVHs are built once
+  this->scene.destroy();
+  this->scene.build(state->models);
+
+  this->pass_step = this->progressive ? kFirstPassStep : 1;
+  this->start_pass(state);
+}
+
+// Stops the tiles of the render, which write into the editor, and
+// frees what the editor owns
+// Waits for the running tiles, the render starts over on the next draw
+void Editor_Raytrace::stop_render(Job_System *jobs) {
+  this->generation++;
+  jobs->cancel(&this->render_jobs);
+  this->needs_redraw = true;
+}
+
+void Editor_Raytrace::destroy(Job_System *jobs) {
+  this->generation++;
+  jobs->cancel(&this->render_jobs);
+  free(this->backbuffer.memory);
+  this->backbuffer = {};
+  free(this->tiles_in_progress);
+  this->tiles_in_progress = NULL;
+  this->scene.destroy();
+  this->scene = {};
+}
+
+void Editor_Raytrace::start_pass(Program_State *state) {
+  int area_width = this->backbuffer.width;
+  int area_height = this->backbuffer.height;
+
+  // Small tiles covering the whole area, the last row and column may
+  // be narrower
+  const int kTileSize = 32;
+  v2i tile_count = {(area_width + kTileSize - 1) / kTileSize,
+                    (area_height + kTileSize - 1) / kTileSize};
+  int num_tiles = tile_count.x * tile_count.y;
+  Raytrace_Tile_Job *tile_jobs =
+      (Raytrace_Tile_Job *)malloc(num_tiles * sizeof(*tile_jobs));
+  for (int y = 0; y < tile_count.y; ++y) {
+    for (int x = 0; x < tile_count.x; ++x) {
+      Raytrace_Tile_Job *job = tile_jobs + y * tile_count.x + x;
+      job->editor = this;
+      job->models = this->scene.models;
+      job->start = V2i(x * kTileSize, y * kTileSize);
+      job->end = V2i(min((x + 1) * kTileSize, area_width),
+                     min((y + 1) * kTileSize, area_height));
+      job->step = this->pass_step;
+      job->refining = this->progressive && this->pass_step < kFirstPassStep;
+      job->generation = this->generation;
+      job->cost = 0;
+    }
+  }
+
+  // Estimate the cost of the tiles by how many instance boxes cover
+  // them. The top level leaves hold one instance each
+  Camera *camera = &this->render_camera;
+  for (int i = 0; i < sb_count(this->scene.bvh.nodes); ++i) {
+    BVH_Node *node = this->scene.bvh.nodes + i;
+    if (node->count == 0) continue;
+    // Boxes crossing the camera plane are assumed to cover everything
+    v2 min_pixel = V2(0, 0);
+    v2 max_pixel = V2((r32)area_width - 1, (r32)area_height - 1);
+    if (project_aabb(camera, node->aabb, &min_pixel, &max_pixel)) {
+      if (max_pixel.x < 0 || max_pixel.y < 0 || min_pixel.x >= area_width ||
+          min_pixel.y >= area_height) {
+        continue;
+      }
+    }
+    v2i min_tile, max_tile;
+    min_tile.x = (int)max(min_pixel.x, 0.0f) / kTileSize;
+    min_tile.y = (int)max(min_pixel.y, 0.0f) / kTileSize;
+    max_tile.x = (int)min(max_pixel.x, (r32)area_width - 1) / kTileSize;
+    max_tile.y = (int)min(max_pixel.y, (r32)area_height - 1) / kTileSize;
+    for (int y = min_tile.y; y <= max_tile.y; ++y) {
+      for (int x = min_tile.x; x <= max_tile.x; ++x) {
+        tile_jobs[y * tile_count.x + x].cost++;
+      }
+    }
+  }
+
+  // Workers steal the oldest jobs first, so the busiest tiles go first
+  qsort(tile_jobs, num_tiles, sizeof(*tile_jobs), compare_tile_jobs_by_cost);
+  for (int i = 0; i < num_tiles; ++i) {
+    state->jobs->add(raytrace_tile_job, tile_jobs + i, sizeof(*tile_jobs),
+                     &this->render_jobs);
+  }
+  free(tile_jobs);
+}
+
+// Shades the lanes of the packet which hit anything. At distance t
+// along a ray a pixel is about `pixel_spread` * t wide, which together
+// with the texel density of the triangle gives the level of detail.
+// Lanes with the same texture are sampled together, with the level of
+// detail of the widest one
+void shade_packet(Model *models, Ray rays[4], Packet_Hit *hit, int lanes,
+                  r32 pixel_spread, u32 colors[4]) {
+  v3 light_source = V3(-1, 2, 3);
+  r32 s[4] = {}, t[4] = {}, footprint[4] = {}, intensities[4] = {};
+  int textured_lanes = 0;
+  for (int lane = 0; lane < 4; ++lane) {
+    if (!(lanes & (1 << lane))) continue;
+    Model *model = models + hit->model_id[lane];
+    Triangle triangle = model->triangles[hit->triangle_id[lane]];
+    v3 hit_point = rays[lane].get_point_at(hit->at.E[lane]);
+    v3 light_dir = (light_source - hit_point).normalized();
+    m4x4 ModelTransform = model->get_transform_matrix();
+    v3 normal = {};
+    for (int i = 0; i < 3; ++i) {
+      normal += model->vns[triangle.indices[i]] *
+                hit->barycentric[i].E[lane];
+    }
+    normal = V3(ModelTransform * V4_v(normal.normalized()));
+    r32 intensity = light_dir * normal;
+    if (intensity < 0) intensity = 0;
+    intensity = lerp(0.2f, 1.0f, intensity);
+    if (model->texture == NULL || model->texture->texels == NULL) {
+      colors[lane] = get_rgb_u32(V3(0.7f, 0.7f, 0.7f) * intensity);
+      continue;
+    }
+
+    Texture *texture = model->texture;
+    v3 *p = model->vertices;
+    v2 *vt = model->vts;
+    int *ids = triangle.indices;
+    v2 texel = {};
+    for (int i = 0; i < 3; ++i) {
+      texel += vt[ids[i]] * hit->barycentric[i].E[lane];
+    }
+    s[lane] = texel.u * texture->width;
+    t[lane] = (1.0f - texel.v) * texture->height;
+
+    // Squared texels per pixel, the areas are doubled in both
+    v3 edge1 = p[ids[1]] - p[ids[0]];
+    v3 edge2 = p[ids[2]] - p[ids[0]];
+    v2 uv1 = vt[ids[1]] - vt[ids[0]];
+    v2 uv2 = vt[ids[2]] - vt[ids[0]];
+    r32 area = edge1.cross(edge2).len() * model->scale * model->scale;
+    r32 texel_area = (uv1.u * uv2.v - uv1.v * uv2.u) * texture->width *
+                     texture->height;
+    if (texel_area < 0) texel_area = -texel_area;
+    r32 pixel_size = hit->at.E[lane] * pixel_spread;
+    footprint[lane] = pixel_size * pixel_size * texel_area / area;
+    intensities[lane] = intensity;
+    textured_lanes |= 1 << lane;
+  }
+
+  while (textured_lanes) {
+    int first = lowest_set_bit(textured_lanes);
+    Texture *texture = models[hit->model_id[first]].texture;
+    int group = 0;
+    r32 max_footprint = 0;
+    for (int lane = first; lane < 4; ++lane) {
+      if ((textured_lanes & (1 << lane)) &&
+          models[hit->model_id[lane]].texture == texture) {
+        group |= 1 << lane;
+        max_footprint = max(max_footprint, footprint[lane]);
+      }
+    }
+    r32 lod = 0.5f * log2f(max_footprint);
+    v4i texels = texture->sample(v4::loadu(s), v4::loadu(t), lod);
+    v4i lit = modulate(texels, v4::loadu(intensities));
+    for (int lane = first; lane < 4; ++lane) {
+      if (group & (1 << lane)) colors[lane] = (u32)lit.E[lane];
     }
+    textured_lanes &= ~group;
   }
 }
 
-void Editor_Raytrace::trace_tile(Model *models, v2i start, v2i end) {
-  Camera camera = this->area->editor_3dview.camera;
+// Offsets of the lanes of the packets in a window of blocks, as x, y
+// pairs. A full pass traces every block of a 2x2 window. A refining pass
+// skips the blocks at even offsets, which the previous pass traced, and
+// packs the other 12 blocks of a 4x4 window into full packets. Together
+// the passes trace every pixel once, in as many packets as a single
+// full resolution pass
+const int kFullWindow = 2;
+const int kFullPackets[1][8] = {{0, 0, 1, 0, 0, 1, 1, 1}};
+const int kRefiningWindow = 4;
+const int kRefiningPackets[3][8] = {
+    {1, 0, 3, 0, 1, 2, 3, 2},
+    {0, 1, 1, 1, 2, 1, 3, 1},
+    {0, 3, 1, 3, 2, 3, 3, 3},
+};
+
+// Traces one pixel per step x step block and fills the block with its
+// color. Tiles start at multiples of the windows, so the blocks at even
+// offsets are the ones traced by the previous pass
+void Editor_Raytrace::trace_tile(Model *models, v2i start, v2i end, int step,
+                                 bool refining, i32 tile_generation) {
+  Camera camera = this->render_camera;
 
-  Ray ray;
   m4x4 CameraSpaceTransform =
       Matrix::frame_to_canonical(camera.get_basis(), camera.position);
-  ray.origin = CameraSpaceTransform * V3(0, 0, 0);
+  v3 origin = CameraSpaceTransform * V3(0, 0, 0);
 
   // Get pixel in camera coordinates
   v2 pixel_size = V2(2 * camera.right / camera.viewport.x,
                      2 * camera.top / camera.viewport.y);
 
-  r32 x_start = -camera.right + pixel_size.x * (0.5f + start.x);
-
-  v3 camera_pixel;
-  camera_pixel.x = x_start;
-  camera_pixel.y = -camera.top + pixel_size.y * (0.5f + start.y);
-  camera_pixel.z = camera.near;
-
-  for (int y = start.y; y < end.y; ++y) {
-    for (int x = start.x; x < end.x; ++x) {
-      ray.direction = CameraSpaceTransform * camera_pixel - ray.origin;
-
-      {
-        Triangle_Hit triangle_hit;
-        triangle_hit.at = INFINITY;
-        int model_id = -1;
-        int object_id = -1;
-        int fan_triangle_id = -1;
-
-        for (int m = 0; m < sb_count(models); ++m) {
-          Model *model = models + m;
-          if (!model->display) continue;
-          if (!ray.hits_aabb(model->aabb)) continue;
-
-          // Put model in the scene
-          m4x4 ModelTransform = model->get_transform_matrix();
-
-          // Look at triangles
-          for (int tr = 0; tr < sb_count(model->triangles); ++tr) {
-            Triangle triangle = model->triangles[tr];
-            v3 vertices[3];
-            for (int i = 0; i < 3; ++i) {
-              vertices[i] =
-                  ModelTransform * model->vertices[triangle.vertices[i].index];
-            }
-            Triangle_Hit hit = ray.hits_triangle(vertices);
-            if (hit.at > 0 && hit.at < triangle_hit.at) {
-              triangle_hit = hit;
-              model_id = m;
-              object_id = tr;
-            }
-          }
+  const u32 kBackgroundColor = EDITOR_BACKGROUND_COLOR * 0x01010101;
+
+  int window = (refining ? kRefiningWindow : kFullWindow) * step;
+  int num_packets = refining ? COUNT_OF(kRefiningPackets) : 1;
+  const int(*packets)[8] = refining ? kRefiningPackets : kFullPackets;
+
+  // Primary rays are coherent, so they are traced in packets of 4
+  for (int y = start.y; y < end.y; y += window) {
+    for (int x = start.x; x < end.x; x += window) {
+      for (int p = 0; p < num_packets; ++p) {
+        v2i blocks[4];
+        v3 pixels[4];
+        for (int lane = 0; lane < 4; ++lane) {
+          blocks[lane] = V2i(x + packets[p][2 * lane] * step,
+                             y + packets[p][2 * lane + 1] * step);
+          pixels[lane].x =
+              -camera.right + pixel_size.x * (0.5f + blocks[lane].x);
+          pixels[lane].y = -camera.top + pixel_size.y * (0.5f + blocks[lane].y);
+          pixels[lane].z = camera.near;
+        }
+        Matrix::transform_points(CameraSpaceTransform, pixels, 4, pixels);
+        Ray rays[4];
+        for (int lane = 0; lane < 4; ++lane) {
+          rays[lane].origin = origin;
+          rays[lane].direction = pixels[lane] - origin;
         }
 
-        // See if we hit anything
-        if (model_id >= 0 && object_id >= 0) {
-          v3 light_source = V3(-1, 2, 3);
-          v3 normal = {};
-          v3 hit_point = ray.get_point_at(triangle_hit.at);
-          v3 light_dir = (light_source - hit_point).normalized();
-          Model *model = models + model_id;
-          m4x4 ModelTransform = model->get_transform_matrix();
-          Triangle triangle = model->triangles[object_id];
-          for (int i = 0; i < 3; ++i) {
-            normal += model->vns[triangle.vertices[i].vn_index] *
-                      triangle_hit.barycentric[i];
-          }
-          normal = V3(ModelTransform * V4_v(normal.normalized()));
-          r32 intensity = light_dir * normal;
-          if (intensity < 0) intensity = 0;
-          intensity = lerp(0.2f, 1.0f, intensity);
-          u32 color;
-          if (model->texture.data != NULL) {
-            v2 texel = {};
-            for (int i = 0; i < 3; ++i) {
-              texel += model->vts[triangle.vertices[i].vt_index] *
-                       triangle_hit.barycentric[i];
+        // Mask out the lanes past the end of the tile
+        v4 lane_x = v4((r32)blocks[0].x, (r32)blocks[1].x, (r32)blocks[2].x,
+                       (r32)blocks[3].x);
+        v4 lane_y = v4((r32)blocks[0].y, (r32)blocks[1].y, (r32)blocks[2].y,
+                       (r32)blocks[3].y);
+        v4 active = v4_and(cmplt(lane_x, v4((r32)end.x)),
+                           cmplt(lane_y, v4((r32)end.y)));
+        int active_lanes = movemask(active);
+        if (!active_lanes) continue;
+
+        Ray_Packet packet = packet_from_rays(rays);
+        Packet_Hit packet_hit;
+        packet_hit.at = v4(INFINITY);
+        int lanes = this->scene.intersect_packet(&packet, active, &packet_hit);
+
+        // Shade the lanes which hit anything and fill their blocks
+        u32 colors[4];
+        shade_packet(models, rays, &packet_hit, lanes & active_lanes,
+                     pixel_size.x, colors);
+        for (int lane = 0; lane < 4; ++lane) {
+          if (!(active_lanes & (1 << lane))) continue;
+          u32 color = kBackgroundColor;
+          if (lanes & (1 << lane)) color = colors[lane];
+          int block_end_x = min(blocks[lane].x + step, end.x);
+          int block_end_y = min(blocks[lane].y + step, end.y);
+          for (int py = blocks[lane].y; py < block_end_y; ++py) {
+            for (int px = blocks[lane].x; px < block_end_x; ++px) {
+              draw_pixel(&this->backbuffer, px, py, color);
             }
-            color = model->texture.color(
-                (int)(texel.x * model->texture.width),
-                (int)((1.0f - texel.y) * model->texture.height), intensity);
-          } else {
-            color = get_rgb_u32(V3(0.7f, 0.7f, 0.7f) * intensity);
           }
-          draw_pixel(&this->backbuffer, x, y, color);
         }
       }
-
-      camera_pixel.x += pixel_size.x;
     }
-    camera_pixel.x = x_start;
-    camera_pixel.y += pixel_size.y;
 
-    // This is a way to abort ray trace if the editor type has changed
-    if (this->area->editor_type != Area_Editor_Type_Raytrace) {
+    // Abort if a newer render has started or the editor has changed
+    if (this->generation != tile_generation ||
+        this->area->editor_type != Area_Editor_Type_Raytrace) {
       return;
     }
   }
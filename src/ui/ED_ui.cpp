@@ -364,17 +364,19 @@ Area *User_Interface::create_area(Area *parent_area, Rect rect, bool smaller) {
     camera->look_at(V3(0, 0, 0));
   }
 
-  // Copy raytrace backbuffer if there is one
+  // The bigger area takes over the raytrace backbuffer if there is one.
+  // Areas which are split never own a backbuffer
   if (parent_area != NULL && !smaller) {
     area->editor_raytrace.backbuffer = parent_area->editor_raytrace.backbuffer;
     area->editor_raytrace.needs_redraw =
         parent_area->editor_raytrace.needs_redraw;
+    parent_area->editor_raytrace.backbuffer = {};
   }
 
   return area;
 }
 
-void User_Interface::remove_area(Area *area) {
+void User_Interface::remove_area(Area *area, Program_State *state) {
   Area *sister_area = NULL;
   Area *parent_area = area->parent_area;
   for (int i = 0; i < 2; ++i) {
@@ -388,6 +390,16 @@ void User_Interface::remove_area(Area *area) {
   parent_area->editor_3dview.camera = sister_area->editor_3dview.camera;
   parent_area->type_select.option_selected = sister_area->editor_type;
 
+  // The parent takes over the backbuffer of the sister area, and
+  // everything else goes with the areas. Their tiles may still be
+  // running, so destroy stops them first
+  parent_area->editor_raytrace.backbuffer =
+      sister_area->editor_raytrace.backbuffer;
+  parent_area->editor_raytrace.needs_redraw = true;
+  sister_area->editor_raytrace.backbuffer = {};
+  area->editor_raytrace.destroy(state->jobs);
+  sister_area->editor_raytrace.destroy(state->jobs);
+
   // Remove splitter
   {
     int splitter_id = -1;
@@ -429,9 +441,6 @@ void User_Interface::remove_area(Area *area) {
       }
     }
 
-    // TODO: maybe free raytrace buffers. Careful though - other areas
-    // may be using them
-
     free(area);
     free(sister_area);
 
@@ -463,7 +472,13 @@ void User_Interface::remove_area(Area *area) {
 }
 
 Area_Splitter *User_Interface::split_area(Area *area, v2i mouse,
-                                          bool is_vertical) {
+                                          bool is_vertical,
+                                          Program_State *state) {
+  // The area stops drawing, and its backbuffer goes to one of the new
+  // areas, so its tiles have to stop before that
+  area->editor_raytrace.generation++;
+  state->jobs->cancel(&area->editor_raytrace.render_jobs);
+
   // Create splitter
   Area_Splitter *splitter;
   {
@@ -586,7 +601,7 @@ Update_Result User_Interface::update_and_draw(User_Input *input,
       if (ui->area_being_deleted == area &&
           area->mouse_over_delete_button(input->mouse) && i > 0) {
         // Note we're not deleting area 0
-        ui->remove_area(area);
+        ui->remove_area(area, state);
         if (ui->active_area == area) {
           ui->active_area = NULL;
         }
@@ -631,7 +646,8 @@ Update_Result User_Interface::update_and_draw(User_Input *input,
           Area_Splitter *splitter;
           bool is_vertical = distance.x > distance.y;
           splitter =
-              ui->split_area(ui->area_being_split, input->mouse, is_vertical);
+              ui->split_area(ui->area_being_split, input->mouse, is_vertical,
+                             state);
           ui->splitter_being_moved = splitter;
           ui->set_movement_boundaries(splitter);
           ui->area_being_split = NULL;
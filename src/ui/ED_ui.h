@@ -107,8 +107,8 @@ struct User_Interface {
   v3 cursor;
 
   Area *create_area(Area *, Rect, bool);
-  void remove_area(Area *);
-  Area_Splitter *split_area(Area *, v2i, bool);
+  void remove_area(Area *, Program_State *);
+  Area_Splitter *split_area(Area *, v2i, bool, Program_State *);
   void set_movement_boundaries(Area_Splitter *);
   void resize_window(int, int);
   Update_Result update_and_draw(User_Input *, Program_State *);